@@ -0,0 +1,160 @@
+// Generate synthetic directory trees for "spy -bench":
+//   DIR/flat    a flat directory of files
+//   DIR/deep    a chain of nested directories, each with a few files
+//   DIR/names   long names, and names that differ only in their numbers
+//   DIR/links   symbolic links to files and directories, and dangling links
+//
+// Usage: gentree [-files N] [-depth N] DIR
+//
+// Place DIR on a tmpfs (eg. /dev/shm) to take the disk out of the results.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+
+static bool makedir(const std::string &path)
+{
+    if (mkdir(path.c_str(), 0755) && errno != EEXIST)
+    {
+        perror(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool touch(const std::string &path, int size = 0)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(path.c_str());
+        return false;
+    }
+    if (size && ftruncate(fd, size))
+        perror(path.c_str());
+    close(fd);
+    return true;
+}
+
+static bool gen_flat(const std::string &dir, int files)
+{
+    if (!makedir(dir))
+        return false;
+
+    char buf[64];
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(buf, sizeof(buf), "/file%07d.%s", i,
+                i % 3 == 0 ? "c" : i % 3 == 1 ? "h" : "txt");
+        if (!touch(dir + buf, i % 4096))
+            return false;
+    }
+    return true;
+}
+
+static bool gen_deep(const std::string &dir, int depth)
+{
+    std::string path = dir;
+    for (int i = 0; i < depth; i++)
+    {
+        if (!makedir(path))
+            return false;
+        for (int j = 0; j < 4; j++)
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "/f%d", j);
+            if (!touch(path + buf))
+                return false;
+        }
+        path += "/d";
+    }
+    return true;
+}
+
+static bool gen_names(const std::string &dir, int files)
+{
+    if (!makedir(dir))
+        return false;
+
+    const std::string longname(200, 'x');
+    char buf[64];
+    for (int i = 0; i < files; i++)
+    {
+        // Numeric runs exercise the integer compare in DIRINFO::operator<
+        snprintf(buf, sizeof(buf), "/v%d.%d.%d", i % 7, i % 101, i);
+        if (!touch(dir + buf))
+            return false;
+
+        if (i % 10 == 0)
+        {
+            snprintf(buf, sizeof(buf), "_%d", i);
+            if (!touch(dir + "/" + longname + buf))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool gen_links(const std::string &dir, int files)
+{
+    if (!makedir(dir) || !makedir(dir + "/target"))
+        return false;
+
+    char buf[64];
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(buf, sizeof(buf), "/file%d", i);
+        std::string file = dir + buf;
+        if (!touch(file))
+            return false;
+
+        snprintf(buf, sizeof(buf), "/link%d", i);
+        const char *target = i % 3 == 0 ? file.c_str() + dir.length() + 1 :
+            i % 3 == 1 ? "target" : "missing";
+        if (symlink(target, (dir + buf).c_str()) && errno != EEXIST)
+        {
+            perror(buf);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int files = 1000000;
+    int depth = 64;
+    const char *dir = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-files") && i+1 < argc)
+            files = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-depth") && i+1 < argc)
+            depth = atoi(argv[++i]);
+        else
+            dir = argv[i];
+    }
+
+    if (!dir)
+    {
+        fprintf(stderr, "usage: %s [-files N] [-depth N] DIR\n", argv[0]);
+        return 1;
+    }
+
+    std::string root = dir;
+    if (!makedir(root) ||
+        !gen_flat(root + "/flat", files) ||
+        !gen_deep(root + "/deep", depth) ||
+        !gen_names(root + "/names", files / 10) ||
+        !gen_links(root + "/links", files / 100))
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Counters for this process, read with perf_event_open(2). Threads started
+// after open() are inherited, but the kernel only adds their counts to the
+// values read here once they exit, so a worker thread that is still running
+// is not included. Each counter is only available if the
+// kernel allows it: hardware counters need a PMU and a perf_event_paranoid
+// setting of 2 or less, and the syscall counter needs a readable tracefs.
+class PERFCOUNTERS {
+public:
+	enum {
+		CYCLES,
+		INSTRUCTIONS,
+		CACHEMISSES,
+		SYSCALLS,
+		COUNT
+	};
+
+	 PERFCOUNTERS() : myOpened(false)
+	{
+		for (int i = 0; i < COUNT; i++)
+			myFds[i] = -1;
+	}
+	~PERFCOUNTERS()
+	{
+		for (int i = 0; i < COUNT; i++)
+		{
+			if (myFds[i] >= 0)
+				close(myFds[i]);
+		}
+	}
+
+	// Open the counters. This is only tried once.
+	void open()
+	{
+		if (myOpened)
+			return;
+		myOpened = true;
+
+		myFds[CYCLES] = openCounter(PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_CPU_CYCLES);
+		myFds[INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_INSTRUCTIONS);
+		myFds[CACHEMISSES] = openCounter(PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_CACHE_MISSES);
+
+		const char	*ids[] = {
+			"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+			"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+		};
+		for (int i = 0; i < 2 && myFds[SYSCALLS] < 0; i++)
+		{
+			FILE	*fp = fopen(ids[i], "r");
+			if (!fp)
+				continue;
+
+			unsigned long long	id;
+			if (fscanf(fp, "%llu", &id) == 1)
+				myFds[SYSCALLS] = openCounter(PERF_TYPE_TRACEPOINT, id);
+			fclose(fp);
+		}
+	}
+
+	bool valid(int counter) const { return myFds[counter] >= 0; }
+
+	// Read the current values. Unavailable counters read as 0.
+	void read(uint64_t values[COUNT]) const
+	{
+		for (int i = 0; i < COUNT; i++)
+		{
+			values[i] = 0;
+			if (myFds[i] >= 0 &&
+				::read(myFds[i], &values[i], sizeof(values[i])) !=
+					sizeof(values[i]))
+				values[i] = 0;
+		}
+	}
+
+private:
+	static int openCounter(uint32_t type, uint64_t config)
+	{
+		perf_event_attr	attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.inherit = 1;
+		attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+		attr.exclude_hv = 1;
+
+		return syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+				PERF_FLAG_FD_CLOEXEC);
+	}
+
+	int		myFds[COUNT];
+	bool	myOpened;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <termcap.h>
 #include <termios.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,30 +11,60 @@
 #include <fnmatch.h>
 #include <wordexp.h>
 #include <pwd.h>
+#include <grp.h>
 #include <regex.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <memory>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <random>
 
 #include "spyrc_defaults.h"
 
 #include "timer.h"
+#include "trace.h"
+#include "perf.h"
 
 // Compile time parameters (could be made settings)
 static const int XPADDING = 1;
 static const bool RELAXCASE = true;
 static const bool HLSEARCH = false;
+static const int STATTHREADS = 8;
+static const int MAXSTATTHREADS = 64;
+static const int STATGRACE = 20;
 
 // Environment
 static const char *s_shell = getenv("SHELL");
@@ -45,6 +76,10 @@ static const char *s_user = getenv("USER");
 // History
 static const std::string s_chistoryfile = std::string(s_home) + "/.spy_history";
 static const std::string s_jhistoryfile = std::string(s_home) + "/.spy_jumps";
+static const std::string s_frecencyfile = std::string(s_home) + "/.spy_frecency";
+
+// Trace export
+static const std::string s_tracefile = std::string(s_home) + "/.spy_trace.json";
 static HISTORY_STATE s_jump_history;
 static HISTORY_STATE s_search_history;
 static HISTORY_STATE s_execute_history;
@@ -52,17 +87,29 @@ static HISTORY_STATE s_execute_history;
 // Child process
 static int thechild = 0;
 
+// Headless mode replays a key script against an in-memory screen. Prompts
+// read their input from the keys that haven't been replayed yet.
+static bool theheadless = false;
+
+// A key read while checking for an interruption, to be handled next
+static int thepushedkey = ERR;
+static std::deque<int> thescriptkeys;
+static const int SCRIPT_WAIT = -2;
+
 // Details mode
 enum DETAIL_TYPE {
     DETAIL_NONE,
     DETAIL_SIZE,
     DETAIL_TIME,
+    DETAIL_OWNER,
+    DETAIL_GROUP,
     DETAIL_MAX
 };
 
 DETAIL_TYPE thedetail = DETAIL_NONE;
 static int thedetailsizewidth = 0;
 static const int thedetailtimewidth = 18;
+static const int thedetailidwidth = 8;
 
 static inline int SYSmax(int a, int b) { return a > b ? a : b; }
 static inline int SYSmin(int a, int b) { return a < b ? a : b; }
@@ -104,10 +151,19 @@ static inline void replaceall_non_escaped(
 }
 
 static void quit_prep();
+static bool fs_stuck();
 
 static void quit()
 {
     quit_prep();
+
+    // Threads blocked on an unresponsive mount or name service can't be
+    // joined
+    if (fs_stuck())
+    {
+        fflush(0);
+        _exit(0);
+    }
     exit(0);
 }
 
@@ -124,21 +180,209 @@ static void signal_handler(int sig)
     }
 }
 
-static bool theresized = false;
+static volatile sig_atomic_t theresized = false;
 
 static void signal_resize(int)
 {
-    // Tell the main event loop that the terminal was resized
+    // Tell the main event loop that the terminal was resized. This is only
+    // reached while a child runs in the foreground; otherwise the signal is
+    // read from theevents.
     theresized = true;
+}
 
-    struct winsize w;
-    ioctl(0, TIOCGWINSZ, &w);
+// The main loop sleeps until something happens: input on the terminal, a
+// signal (read from a signalfd), a wakeup from a background worker (an
+// eventfd) or a change to the current directory (inotify).
+class EVENTLOOP {
+public:
+    enum {
+        INPUT = 1,
+        SIGNAL = 2,
+        WAKE = 4,
+        CHANGE = 8
+    };
+
+    EVENTLOOP()
+        : myepoll(-1)
+        , mysignal(-1)
+        , mywake(-1)
+        , mynotify(-1)
+        , mytty(-1)
+        , mywatch(-1)
+        , myfilewatch(-1)
+    {}
+
+    // Block the signals read from the signalfd. This must be called before
+    // any threads are started, since they inherit the signal mask.
+    void init()
+    {
+        sigemptyset(&mysignals);
+        sigaddset(&mysignals, SIGINT);
+        sigaddset(&mysignals, SIGTERM);
+        sigaddset(&mysignals, SIGWINCH);
+        sigaddset(&mysignals, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mysignals, 0);
+
+        myepoll = epoll_create1(EPOLL_CLOEXEC);
+        mysignal = signalfd(-1, &mysignals, SFD_NONBLOCK | SFD_CLOEXEC);
+        mywake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        mynotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        add(mysignal, SIGNAL);
+        add(mywake, WAKE);
+        add(mynotify, CHANGE);
+    }
+
+    void settty(int fd)
+    {
+        mytty = fd;
+        add(fd, INPUT);
+    }
+
+    // Foreground children are run with the signals unblocked, so that they
+    // start with the default mask and SIGINT reaches signal_handler()
+    void unblock() { sigprocmask(SIG_UNBLOCK, &mysignals, 0); }
+    void block() { sigprocmask(SIG_BLOCK, &mysignals, 0); }
+
+    // Wake the main loop. This may be called from any thread.
+    void wake()
+    {
+        uint64_t one = 1;
+        if (write(mywake, &one, sizeof(one)) < 0)
+            return;
+    }
+
+    // Watch dir for entries being added, removed or renamed
+    void watch(const char *dir)
+    {
+        if (mynotify < 0 || mywatchdir == dir)
+            return;
+        if (mywatch >= 0)
+            inotify_rm_watch(mynotify, mywatch);
+        mywatch = inotify_add_watch(mynotify, dir,
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        mywatchdir = dir;
+    }
+
+    // Also watch a file for its contents changing, eg. to follow a log.
+    // This is reported as a CHANGE too.
+    void watchfile(const char *path)
+    {
+        unwatchfile();
+        if (mynotify >= 0)
+            myfilewatch = inotify_add_watch(mynotify, path, IN_MODIFY);
+    }
+    void unwatchfile()
+    {
+        if (myfilewatch >= 0)
+            inotify_rm_watch(mynotify, myfilewatch);
+        myfilewatch = -1;
+    }
+
+    // Wait up to ms milliseconds (or indefinitely if negative) and return
+    // the events that occurred. The signals received are added to signals.
+    int wait(int ms, std::vector<int> &signals)
+    {
+        struct epoll_event events[4];
+        int n = epoll_wait(myepoll, events, 4, ms);
+
+        int mask = 0;
+        for (int i = 0; i < n; i++)
+            mask |= events[i].data.u32;
 
-    char buf[16];
-    sprintf(buf, "%d", w.ws_row);
-    setenv("LINES", buf, true);
-    sprintf(buf, "%d", w.ws_col);
-    setenv("COLUMNS", buf, true);
+        if (mask & SIGNAL)
+            readsignals(signals);
+        if (mask & WAKE)
+        {
+            uint64_t count;
+            if (read(mywake, &count, sizeof(count)) < 0)
+                mask &= ~WAKE;
+        }
+        if (mask & CHANGE)
+        {
+            // Removing the watch on the previous directory queues an
+            // IN_IGNORED for it, which isn't a change to the listing
+            bool changed = false;
+            char buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(mynotify, buf, sizeof(buf))) > 0)
+            {
+                for (char *p = buf; p < buf + len; )
+                {
+                    const struct inotify_event *event =
+                        (const struct inotify_event *)p;
+                    if (!(event->mask & IN_IGNORED))
+                        changed = true;
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if (!changed)
+                mask &= ~CHANGE;
+        }
+        return mask;
+    }
+
+    // Wait for terminal input only, for prompts run by the key callbacks
+    void waitinput(std::vector<int> &signals)
+    {
+        struct pollfd fds[2] = {
+            { mytty, POLLIN, 0 },
+            { mysignal, POLLIN, 0 }
+        };
+        if (poll(fds, 2, -1) > 0 && fds[1].revents)
+            readsignals(signals);
+    }
+
+private:
+    void add(int fd, int event)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        ev.data.u32 = event;
+        epoll_ctl(myepoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void readsignals(std::vector<int> &signals)
+    {
+        struct signalfd_siginfo info;
+        while (read(mysignal, &info, sizeof(info)) == sizeof(info))
+            signals.push_back(info.ssi_signo);
+    }
+
+    sigset_t mysignals;
+    int myepoll;
+    int mysignal;
+    int mywake;
+    int mynotify;
+    int mytty;
+    int mywatch;
+    int myfilewatch;
+    std::string mywatchdir;
+};
+
+static EVENTLOOP theevents;
+
+// Handle the signals read by theevents
+static void handle_signals(const std::vector<int> &signals)
+{
+    for (auto it = signals.begin(); it != signals.end(); ++it)
+    {
+        switch (*it)
+        {
+            case SIGINT:
+            case SIGTERM:
+                quit();
+                break;
+            case SIGWINCH:
+                theresized = true;
+                break;
+            case SIGCHLD:
+                // Foreground children are reaped where they are run
+                break;
+        }
+    }
 }
 
 struct ci_equal {
@@ -197,28 +441,356 @@ private:
     bool m_valid;
 };
 
+// Database of visited directories ranked by "frecency": the number of
+// visits weighted by how recently the directory was last visited. Lookups
+// by path fragment go through a trigram index, or an index of directory
+// names for fragments too short to have a trigram.
+class FRECENCY {
+public:
+    FRECENCY() : mytotal(0) {}
+
+    bool load(const std::string &fname)
+    {
+        FILE *fp = fopen(fname.c_str(), "r");
+        if (!fp)
+            return false;
+
+        char line[FILENAME_MAX+64];
+        while (fgets(line, sizeof(line), fp))
+        {
+            ENTRY entry;
+            char *path = 0;
+            entry.count = strtod(line, &path);
+            if (*path++ != '\t')
+                continue;
+            entry.time = strtoll(path, &path, 10);
+            if (*path++ != '\t')
+                continue;
+
+            path[strcspn(path, "\n")] = '\0';
+            entry.path = path;
+            if (!entry.path.empty() && !myids.count(entry.path))
+                add(entry);
+        }
+
+        fclose(fp);
+        return true;
+    }
+
+    // Import a list of directories, oldest first, such as a readline
+    // history file
+    void import(const std::string &fname, time_t now)
+    {
+        std::ifstream is(fname);
+        std::vector<std::string> paths;
+        std::string line;
+        while (std::getline(is, line))
+        {
+            if (!line.empty() && line[0] != '#')
+                paths.push_back(line);
+        }
+
+        for (int i = 0; i < paths.size(); i++)
+            visit(paths[i], now - (paths.size() - i));
+    }
+
+    bool save(const std::string &fname) const
+    {
+        // Write a temporary file and rename it, so that a concurrent spy
+        // never reads a partial database
+        std::string tmpname = fname + ".tmp";
+        FILE *fp = fopen(tmpname.c_str(), "w");
+        if (!fp)
+            return false;
+
+        for (auto it = myentries.begin(); it != myentries.end(); ++it)
+            fprintf(fp, "%g\t%lld\t%s\n", it->count, (long long)it->time,
+                    it->path.c_str());
+
+        return !fclose(fp) && !rename(tmpname.c_str(), fname.c_str());
+    }
+
+    void visit(const std::string &path, time_t now)
+    {
+        auto it = myids.find(path);
+        if (it != myids.end())
+        {
+            myentries[it->second].count += 1;
+            myentries[it->second].time = now;
+            mytotal += 1;
+        }
+        else
+        {
+            // add() counts the entry in mytotal
+            ENTRY entry;
+            entry.path = path;
+            entry.count = 1;
+            entry.time = now;
+            add(entry);
+
+            if (myentries.size() > MAXENTRIES)
+                prune(now);
+        }
+
+        if (mytotal > MAXTOTAL)
+            age();
+    }
+
+    // Find the highest ranked directory other than exclude containing
+    // fragment (ignoring case)
+    const std::string *find(const std::string &fragment,
+            const std::string &exclude, time_t now) const
+    {
+        if (fragment.empty())
+            return 0;
+
+        std::string lower = fragment;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+        // Find a small list of candidates from the indexes
+        const std::vector<int> *candidates = 0;
+        std::vector<int> named;
+        if (lower.length() >= 3)
+        {
+            for (int i = 0; i+3 <= lower.length(); i++)
+            {
+                auto it = mytrigrams.find(trigram(&lower[i]));
+                if (it == mytrigrams.end())
+                    return 0;
+                if (!candidates || it->second.size() < candidates->size())
+                    candidates = &it->second;
+            }
+        }
+        else
+        {
+            for (auto it = mynames.lower_bound(lower);
+                    it != mynames.end() &&
+                    !it->first.compare(0, lower.length(), lower); ++it)
+                named.push_back(it->second);
+            if (!named.empty())
+                candidates = &named;
+        }
+
+        const ENTRY *best = 0;
+        double bestscore = 0;
+        for (int i = 0; i < (candidates ? candidates->size() : myentries.size()); i++)
+        {
+            const ENTRY &entry = myentries[candidates ? (*candidates)[i] : i];
+            if (entry.path == exclude ||
+                    ci_find_substr(entry.path, fragment) < 0)
+                continue;
+
+            double s = score(entry, now);
+            if (!best || s > bestscore)
+            {
+                best = &entry;
+                bestscore = s;
+            }
+        }
+
+        return best ? &best->path : 0;
+    }
+
+    // List the directories from least to most recently visited
+    void recent(std::vector<std::string> &paths) const
+    {
+        std::vector<const ENTRY *> sorted;
+        for (auto it = myentries.begin(); it != myentries.end(); ++it)
+            sorted.push_back(&*it);
+        std::sort(sorted.begin(), sorted.end(),
+                [](const ENTRY *a, const ENTRY *b) { return a->time < b->time; });
+
+        paths.clear();
+        for (auto it = sorted.begin(); it != sorted.end(); ++it)
+            paths.push_back((*it)->path);
+    }
+
+private:
+    struct ENTRY {
+        std::string path;
+        double count;
+        time_t time;
+    };
+
+    // Once the visit counts add up to this, they are scaled down so that
+    // directories that are no longer visited rank below the current ones
+    static const int MAXTOTAL = 10000;
+
+    // Once there are more directories than this, the lowest ranked tenth
+    // of them is dropped
+    static const size_t MAXENTRIES = 100000;
+
+    static double score(const ENTRY &entry, time_t now)
+    {
+        time_t age = now - entry.time;
+        if (age < 60*60)
+            return entry.count * 4;
+        if (age < 60*60*24)
+            return entry.count * 2;
+        if (age < 60*60*24*7)
+            return entry.count / 2;
+        return entry.count / 4;
+    }
+
+    static uint32_t trigram(const char *str)
+    {
+        return ((uint8_t)str[0] << 16) | ((uint8_t)str[1] << 8) | (uint8_t)str[2];
+    }
+
+    void add(const ENTRY &entry)
+    {
+        int id = myentries.size();
+        myentries.push_back(entry);
+        myids[entry.path] = id;
+        mytotal += entry.count;
+
+        std::string lower = entry.path;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+        std::vector<uint32_t> trigrams;
+        for (int i = 0; i+3 <= lower.length(); i++)
+            trigrams.push_back(trigram(&lower[i]));
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                trigrams.end());
+        for (auto it = trigrams.begin(); it != trigrams.end(); ++it)
+            mytrigrams[*it].push_back(id);
+
+        mynames.insert(std::make_pair(lower.substr(lower.rfind('/')+1), id));
+    }
+
+    // Scale the counts down in place, which leaves the indexes alone
+    void age()
+    {
+        for (auto it = myentries.begin(); it != myentries.end(); ++it)
+            it->count *= 0.9;
+        mytotal *= 0.9;
+    }
+
+    // Drop the lowest ranked directories and rebuild the indexes
+    void prune(time_t now)
+    {
+        std::vector<std::pair<double, int>> ranked;
+        for (int i = 0; i < myentries.size(); i++)
+            ranked.push_back(std::make_pair(score(myentries[i], now), i));
+        const size_t keep = MAXENTRIES / 10 * 9;
+        std::nth_element(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                [](const std::pair<double, int> &a,
+                   const std::pair<double, int> &b) { return a.first > b.first; });
+        ranked.resize(keep);
+        std::sort(ranked.begin(), ranked.end(),
+                [](const std::pair<double, int> &a,
+                   const std::pair<double, int> &b) { return a.second < b.second; });
+
+        std::vector<ENTRY> entries;
+        entries.swap(myentries);
+
+        myids.clear();
+        mytrigrams.clear();
+        mynames.clear();
+        mytotal = 0;
+
+        for (auto it = ranked.begin(); it != ranked.end(); ++it)
+            add(entries[it->second]);
+    }
+
+    std::vector<ENTRY> myentries;
+    std::map<std::string, int> myids;
+    std::map<uint32_t, std::vector<int>> mytrigrams;
+    std::multimap<std::string, int> mynames;
+    double mytotal;
+};
+
+static FRECENCY thefrecency;
+
+struct ROWCACHE;
+
+// The number of lstat() calls made, for the performance overlay
+static std::atomic<int> thestatcalls(0);
+
 class DIRINFO {
 public:
-    DIRINFO() : mydirectory(false) {}
+    DIRINFO()
+        : mydirectory(false)
+        , myunknown(false)
+        , mystale(false)
+        , myline(0)
+        , mypathlen(0)
+    {}
 
     const std::string &name() const { return myname; }
     void setname(const char *name) { myname = name; }
 
+    // Content search matches are named "path:line: text", and refer to the
+    // file at path
+    void setmatch(const std::string &path, int line, const std::string &text)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), ":%d: ", line);
+        myname = path + buf + text;
+        myline = line;
+        mypathlen = path.length();
+    }
+    int line() const { return myline; }
+    std::string path() const
+    { return myline ? myname.substr(0, mypathlen) : myname; }
+
+    // Order matches by path and then line
+    bool match_less(const DIRINFO &rhs) const
+    {
+        int cmp = myname.compare(0, mypathlen, rhs.myname, 0, rhs.mypathlen);
+        return cmp ? cmp < 0 : myline < rhs.myline;
+    }
+
     bool isdirectory() const { return mydirectory; }
     void setdirectory() { mydirectory = true; }
 
-    void setdirectory_from_stat()
+    // The filesystem didn't report the type, so whether this is a directory
+    // is only known once the stat data arrives
+    bool isunknown() const { return myunknown; }
+    void setunknown() { myunknown = true; }
+
+    // The stat data is never fetched here, since that could block the UI
+    // thread on a slow or dead filesystem. It is read as zero until
+    // parallel_stat() or the STATQUEUE workers have set it.
+    bool isexecute() const { return st().st_mode & S_IXUSR; }
+    bool iswrite() const { return st().st_mode & S_IWUSR; }
+    bool islink() const { return (st().st_mode & S_IFMT) == S_IFLNK; }
+
+    size_t size() const { return st().st_size; }
+    time_t modtime() const { return st().st_mtime; }
+    mode_t mode() const { return st().st_mode; }
+    uid_t uid() const { return st().st_uid; }
+    gid_t gid() const { return st().st_gid; }
+
+    // Stat data fetched by a background worker
+    bool hasstat() const { return mystat.get(); }
+    void setstat(const struct stat &st)
     {
-        lazy_stat();
-        mydirectory = S_ISDIR(mystat->st_mode);
+        mystat.reset(new struct stat(st));
+        myrow.reset();
+        if (myunknown)
+        {
+            mydirectory = S_ISDIR(st.st_mode);
+            myunknown = false;
+        }
     }
 
-    bool isexecute() const { lazy_stat(); return mystat->st_mode & S_IXUSR; }
-    bool iswrite() const { lazy_stat(); return mystat->st_mode & S_IWUSR; }
-    bool islink() const { lazy_stat(); return (mystat->st_mode & S_IFMT) == S_IFLNK; }
+    // The path to lstat() for this entry
+    std::string statpath() const { return myline ? path() : myname; }
+
+    // Mark an entry that couldn't be stat'ed or listed because its
+    // filesystem stopped responding
+    void setstale()
+    {
+        mystat.reset(new struct stat());
+        myrow.reset();
+        mystale = true;
+    }
+    bool isstale() const { return mystale; }
 
-    size_t size() const { lazy_stat(); return mystat->st_size; }
-    time_t modtime() const { lazy_stat(); return mystat->st_mtime; }
+    // The row last drawn for this entry
+    std::shared_ptr<ROWCACHE> &rowcache() const { return myrow; }
 
     bool operator<(const DIRINFO &rhs) const
     {
@@ -241,6 +813,18 @@ public:
                     return modtime() > rhs.modtime();
                 }
                 break;
+            case DETAIL_OWNER:
+                if (uid() != rhs.uid())
+                {
+                    return uid() < rhs.uid();
+                }
+                break;
+            case DETAIL_GROUP:
+                if (gid() != rhs.gid())
+                {
+                    return gid() < rhs.gid();
+                }
+                break;
         }
 
         // Lexicographic compare that extracts integers and compares them
@@ -294,27 +878,116 @@ public:
     }
 
 private:
-    void lazy_stat() const
+    const struct stat &st() const
     {
-        if (!mystat)
-        {
-            mystat.reset(new struct stat);
-
-            // Use lstat rather than stat so that symbolic links are not
-            // followed, and we can get information about the link itself
-            lstat(myname.c_str(), mystat.get());
-        }
+        static const struct stat zero = {};
+        return mystat ? *mystat : zero;
     }
 
     std::string myname;
-    mutable std::shared_ptr<struct stat> mystat;
+    std::shared_ptr<struct stat> mystat;
+    mutable std::shared_ptr<ROWCACHE> myrow;
     bool mydirectory;
+    bool myunknown;
+    bool mystale;
+    int myline;
+    int mypathlen;
 };
 
 static const int BUFSIZE = 1024;
 
 // File/directory state
 static std::vector<DIRINFO> thefiles;
+
+// The visible entries, as indices into thefiles. This is the identity
+// mapping unless a filter is active. All navigation (thecurfile, pages) is
+// relative to the view.
+static std::vector<int> theview;
+
+static inline int nfiles() { return theview.size(); }
+static inline const DIRINFO &getfile(int file) { return thefiles[theview[file]]; }
+
+// A bit per entry of thefiles, for tagging entries
+class TAGS {
+public:
+    TAGS() : mycount(0) {}
+
+    void clear()
+    {
+        mybits.clear();
+        mycount = 0;
+    }
+    int count() const { return mycount; }
+
+    bool test(int i) const
+    {
+        const size_t word = i >> 6;
+        return word < mybits.size() && ((mybits[word] >> (i & 63)) & 1);
+    }
+    void set(int i, bool on)
+    {
+        const size_t word = i >> 6;
+        if (word >= mybits.size())
+        {
+            if (!on)
+                return;
+            mybits.resize(word+1, 0);
+        }
+
+        const uint64_t bit = 1ull << (i & 63);
+        if (on != !!(mybits[word] & bit))
+        {
+            mybits[word] ^= bit;
+            mycount += on ? 1 : -1;
+        }
+    }
+    void toggle(int i) { set(i, !test(i)); }
+
+    // The tagged entries in order
+    void indices(std::vector<int> &list) const
+    {
+        list.clear();
+        list.reserve(mycount);
+        for (size_t word = 0; word < mybits.size(); word++)
+        {
+            for (uint64_t bits = mybits[word]; bits; bits &= bits-1)
+                list.push_back(word*64 + __builtin_ctzll(bits));
+        }
+    }
+
+private:
+    std::vector<uint64_t> mybits;
+    int mycount;
+};
+
+static TAGS thetags;
+
+// The paths of the tagged entries, to tag them again once thefiles is
+// rebuilt or reordered
+static void save_tags(std::vector<std::string> &paths)
+{
+    std::vector<int> tagged;
+    thetags.indices(tagged);
+
+    paths.clear();
+    for (auto it = tagged.begin(); it != tagged.end(); ++it)
+        paths.push_back(thefiles[*it].name());
+    std::sort(paths.begin(), paths.end());
+}
+
+static void restore_tags(const std::vector<std::string> &paths)
+{
+    thetags.clear();
+    if (paths.empty())
+        return;
+
+    for (int i = 0; i < (int)thefiles.size(); i++)
+    {
+        if (std::binary_search(paths.begin(), paths.end(), thefiles[i].name()))
+            thetags.set(i, true);
+    }
+}
+
 static char thecwd[FILENAME_MAX];
 static char thehostname[BUFSIZE];
 
@@ -336,6 +1009,65 @@ static int thecols = 0;
 static std::string themsg;
 static bool thedebugmode = false;
 
+// The performance overlay extends debug mode with key-to-paint latency,
+// the frame rate, and the cost of the last rebuild and draw
+static bool theperfoverlay = false;
+static PERFCOUNTERS theperf;
+
+struct PERFSAMPLE {
+    uint64_t counters[PERFCOUNTERS::COUNT];
+    int stats;
+};
+static PERFSAMPLE therebuildperf;
+static PERFSAMPLE thedrawperf;
+
+// Recent key-to-paint latencies in milliseconds, and the times of the draws
+// in the last second
+static std::deque<double> thelatencies;
+static std::deque<uint64_t> theframes;
+
+static void perf_begin(PERFSAMPLE &sample)
+{
+    if (!theperfoverlay)
+        return;
+    theperf.read(sample.counters);
+    sample.stats = thestatcalls;
+}
+
+static void perf_end(PERFSAMPLE &sample)
+{
+    if (!theperfoverlay)
+        return;
+    uint64_t counters[PERFCOUNTERS::COUNT];
+    theperf.read(counters);
+    for (int i = 0; i < PERFCOUNTERS::COUNT; i++)
+        sample.counters[i] = counters[i] - sample.counters[i];
+    sample.stats = thestatcalls - sample.stats;
+}
+
+// Record the latency from reading a key to painting its result
+static void record_latency(uint64_t keytime)
+{
+    thelatencies.push_back((TRACE::now() - keytime) / 1e6);
+    if (thelatencies.size() > 256)
+        thelatencies.pop_front();
+}
+
+// Damage tracking. The page, current file and message shown by the last
+// frame are kept so that draw() can repaint only what changed. Anything that
+// changes the layout or listing, or draws outside of draw(), must call
+// damage() to force a full repaint.
+static bool thedamaged = true;
+static int thedrawnpage = -1;
+static int thedrawnfile = -1;
+static std::string thedrawnmsg;
+static int thecellswritten = 0;
+
+// Keystrokes whose repaint was folded into a later one
+static int themergedkeys = 0;
+
+static void damage() { thedamaged = true; }
+
 // Search info
 static std::unique_ptr<SPY_REGEX> thesearch;
 
@@ -377,6 +1109,18 @@ struct COLOR {
 
 static std::vector<COLOR> thecolors;
 
+// The details and name of an entry composed with their attributes, so that
+// the row can be drawn with a single addchnstr(). The row is valid for the
+// detail mode, size column width and time epoch it was composed for.
+struct ROWCACHE {
+    std::vector<chtype> myrow;
+    int mynamestart;
+    int mydetail;
+    int mysizewidth;
+    time_t myepoch;
+    bool mytagged;
+};
+
 // Ignore info
 struct IGNOREMASK {
     IGNOREMASK() : myenable(true) {}
@@ -387,9 +1131,10 @@ struct IGNOREMASK {
 
 static std::map<std::string, IGNOREMASK> theignoremask;
 
-static bool ignored(const char *name)
+static bool ignored(const char *name,
+        const std::map<std::string, IGNOREMASK> &masks = theignoremask)
 {
-    for (auto it = theignoremask.begin(); it != theignoremask.end(); ++it)
+    for (auto it = masks.begin(); it != masks.end(); ++it)
     {
         const IGNOREMASK &mask = it->second;
         if (mask.myenable)
@@ -405,820 +1150,5149 @@ static bool ignored(const char *name)
     return false;
 }
 
-static int itoawidth(size_t size)
-{
-    int width = 0;
-    while (size)
+// Runs filesystem calls that could block forever on an unresponsive mount
+// (such as a dead NFS server) on a worker thread, so that the UI waits for
+// at most a timeout rather than hanging in the kernel. A call that makes no
+// progress for the timeout is abandoned: its worker stays blocked and holds
+// one of the mount's MAXPERMOUNT slots until the call returns, and the
+// mount is reported as stale. A call waits for a slot while the mount's
+// slots are held by calls that are still running normally, but once one
+// has timed out, calls on it fail straight away instead of starting more
+// workers that would block. Background stat calls take slots from a
+// separate budget per mount, sized by the filesystem's profile.
+class FSGUARD {
+public:
+    static const int MAXPERMOUNT = 4;
+    static const int POLLMS = 50;
+
+    FSGUARD() : mytimeout(2000), mymountinfo(-1) {}
+
+    // The timeout in milliseconds, where 0 waits indefinitely
+    void settimeout(int ms) { mytimeout = ms; }
+
+    // Load the mount table, or reload it if it has changed since. The
+    // kernel reports a change as an exceptional condition on the file.
+    void loadmounts()
     {
-        width++;
-        size /= 10;
+        if (mymountinfo >= 0)
+        {
+            pollfd pfd = { mymountinfo, POLLPRI, 0 };
+            if (poll(&pfd, 1, 0) <= 0)
+                return;
+        }
+        else
+        {
+            mymountinfo = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+            if (mymountinfo < 0)
+                return;
+        }
+
+        std::string text;
+        char buf[4096];
+        ssize_t n;
+        lseek(mymountinfo, 0, SEEK_SET);
+        while ((n = ::read(mymountinfo, buf, sizeof(buf))) > 0)
+            text.append(buf, n);
+
+        std::vector<std::string> mounts;
+        for (size_t start = 0, end; start < text.length(); start = end + 1)
+        {
+            end = text.find('\n', start);
+            if (end == std::string::npos)
+                end = text.length();
+
+            // The mount point is the fifth field, with spaces and other
+            // special characters escaped as octal
+            size_t field = start;
+            for (int i = 0; i < 4 && field < end; i++)
+                field = text.find(' ', field) + 1;
+            std::string mount = text.substr(field,
+                    text.find(' ', field) - field);
+            for (size_t pos; (pos = mount.find('\\')) != std::string::npos; )
+                mount.replace(pos, 4, 1,
+                        (char)strtol(mount.substr(pos+1, 3).c_str(), 0, 8));
+            mounts.push_back(mount);
+        }
+
+        std::lock_guard<std::mutex> lock(mylock);
+        mymountpoints.swap(mounts);
     }
-    return SYSmax(width, 1);
-}
 
-static void layout(const std::vector<DIRINFO> &dirs, int ysize, int xsize)
-{
-    int maxwidth = 0;
-    for (int i = 0; i < dirs.size(); i++)
+    // The mount point holding an absolute path, found from the path alone
+    // so that a dead mount is never touched
+    std::string mount(const std::string &path)
     {
-        maxwidth = SYSmax(maxwidth, dirs[i].name().length());
+        std::lock_guard<std::mutex> lock(mylock);
+        std::string best = "/";
+        for (auto it = mymountpoints.begin(); it != mymountpoints.end(); ++it)
+        {
+            if (it->length() > best.length() &&
+                    !path.compare(0, it->length(), *it) &&
+                    (path.length() == it->length() ||
+                     path[it->length()] == '/'))
+                best = *it;
+        }
+        return best;
     }
 
-    maxwidth += XPADDING;
-    switch (thedetail)
+    // Take a slot on a mount for a call. If they are all held, wait up to
+    // ms milliseconds (or indefinitely if negative) for one to be released,
+    // but fail straight away once a call on the mount has timed out.
+    bool acquire(const std::string &mount, int ms = 0)
     {
-        case DETAIL_NONE:
-            maxwidth += 2;
-            break;
-        case DETAIL_SIZE:
-            {
-                size_t maxsize = 0;
-                for (int i = 0; i < dirs.size(); i++)
-                {
-                    maxsize = SYSmax(maxsize, dirs[i].size());
-                }
-                thedetailsizewidth = itoawidth(maxsize);
-                maxwidth += thedetailsizewidth+2;
+        const auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(SYSmax(ms, 0));
+
+        std::unique_lock<std::mutex> lock(mylock);
+        SLOTS &slots = myslots[mount];
+        while (slots.active >= MAXPERMOUNT)
+        {
+            if (slots.stuck || !ms)
+                return false;
+            if (ms < 0)
+                myreleased.wait(lock);
+            else if (myreleased.wait_until(lock, deadline) ==
+                    std::cv_status::timeout)
+                return false;
+        }
+        slots.active++;
+        return true;
+    }
+    void release(const std::string &mount, bool timedout = false)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        SLOTS &slots = myslots[mount];
+        slots.active--;
+        if (timedout)
+            slots.stuck--;
+        myreleased.notify_all();
+    }
+
+    // Take one of limit slots on a mount for a background stat call. These
+    // are kept apart from the MAXPERMOUNT slots, so that a queue of stats
+    // never holds up a listing. Waits for a slot, but fails once a call on
+    // the mount has timed out.
+    bool acquirestat(const std::string &mount, int limit)
+    {
+        std::unique_lock<std::mutex> lock(mylock);
+        SLOTS &slots = myslots[mount];
+        while (slots.stats >= limit)
+        {
+            if (slots.stuck)
+                return false;
+            myreleased.wait(lock);
+        }
+        slots.stats++;
+        return true;
+    }
+    void releasestat(const std::string &mount)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        myslots[mount].stats--;
+        myreleased.notify_all();
+    }
+
+    // Run fn, which calls into the filesystem holding path (an absolute
+    // path), waiting until it has made no progress for the timeout. fn may
+    // count its progress in *progress. poll is called every POLLMS while
+    // waiting, eg. to let a key stop fn. Returns false if the call timed
+    // out or the mount is unreachable. After a timeout fn carries on in
+    // the background, so it must only refer to state that it shares
+    // ownership of.
+    bool run(const std::string &path, const std::function<void()> &fn,
+             const std::atomic<int> *progress = 0,
+             const std::function<void()> &poll = std::function<void()>())
+    {
+        const std::string mount = this->mount(path);
+        if (!acquire(mount, mytimeout ? mytimeout : -1))
+            return false;
+
+        struct CALL {
+            std::mutex lock;
+            std::condition_variable cond;
+            bool done;
+            bool timedout;
+        };
+        std::shared_ptr<CALL> call(new CALL);
+        call->done = false;
+        call->timedout = false;
+
+        std::thread([this, call, fn, mount]()
+        {
+            fn();
+
+            std::lock_guard<std::mutex> lock(call->lock);
+            call->done = true;
+            release(mount, call->timedout);
+            call->cond.notify_all();
+        }).detach();
+
+        const int slice = poll || !mytimeout ? POLLMS : mytimeout;
+        int last = progress ? progress->load() : 0;
+        int idle = 0;
+
+        std::unique_lock<std::mutex> lock(call->lock);
+        while (!call->cond.wait_for(lock, std::chrono::milliseconds(slice),
+                    [&]() { return call->done; }))
+        {
+            if (poll)
+                poll();
+
+            const int now = progress ? progress->load() : 0;
+            idle = now == last ? idle + slice : 0;
+            last = now;
+            if (mytimeout && idle >= mytimeout)
+            {
+                call->timedout = true;
+                std::lock_guard<std::mutex> slotlock(mylock);
+                myslots[mount].stuck++;
+                myreleased.notify_all();
+                return false;
             }
-            break;
-        case DETAIL_TIME:
-            maxwidth += thedetailtimewidth+2;
-            break;
+        }
+        return true;
     }
 
-    therows = SYSmax(ysize, 1);
-    thecols = xsize / (maxwidth + XPADDING);
-    thecols = SYSmax(thecols, 1);
+    // Whether a call on the mount holding path has timed out and not
+    // returned
+    bool stale(const std::string &path)
+    {
+        const std::string mount = this->mount(path);
+        std::lock_guard<std::mutex> lock(mylock);
+        auto it = myslots.find(mount);
+        return it != myslots.end() && it->second.stuck > 0;
+    }
 
-    thepages = (dirs.size()-1) / (thecols * therows) + 1;
-}
+    // Whether any call is still running, possibly blocked
+    bool busy()
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        for (auto it = myslots.begin(); it != myslots.end(); ++it)
+        {
+            if (it->second.active || it->second.stats)
+                return true;
+        }
+        return false;
+    }
 
-static void filetopage(int file, int &page, int &col, int &row)
-{
-    page = file / (therows*thecols);
+private:
+    struct SLOTS {
+        SLOTS() : active(0), stuck(0), stats(0) {}
+        int active;
+        int stuck;
+        int stats;
+    };
 
-    file %= (therows*thecols);
-    col = file / therows;
-    row = file % therows;
+    std::mutex mylock;
+    // Notified when a slot is released or a mount becomes stuck
+    std::condition_variable myreleased;
+    std::vector<std::string> mymountpoints;
+    std::map<std::string, SLOTS> myslots;
+    int mytimeout;
+    int mymountinfo;
+};
+
+static FSGUARD thefsguard;
+
+#ifndef FUSE_SUPER_MAGIC
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
+
+// How to read directories on a kind of filesystem, picked by the type that
+// statfs(2) reports when a directory is listed. A stat is a cache hit on
+// tmpfs and usually on a local disk, a round trip to the server on NFS, and
+// a call through a user space server, which may handle one at a time, on
+// FUSE. The profiles can be changed in .spyrc.
+class FSPROFILE {
+public:
+    const char *myname;
+    // Threads stat'ing entries at once
+    int mythreads;
+    // Whether the whole directory is stat'ed in the background for
+    // colors, rather than just the pages around the current one
+    bool mystatall;
+    // Seconds that a listing read for completion stays cached
+    int mycachettl;
+    // KB read ahead from the highlighted file, or 0 for none
+    int myprefetch;
+};
+
+static FSPROFILE thefsprofiles[] = {
+    { "local", STATTHREADS, true, 60, 4096 },
+    { "tmpfs", 2, true, 300, 0 },
+    { "nfs", 16, false, 5, 8192 },
+    { "fuse", 2, false, 5, 1024 },
+    { "ceph", 16, true, 10, 16384 },
+};
+
+static FSPROFILE &fsprofile(long type)
+{
+    switch (type)
+    {
+        case TMPFS_MAGIC:
+        case RAMFS_MAGIC:
+            return thefsprofiles[1];
+        case NFS_SUPER_MAGIC:
+        case SMB_SUPER_MAGIC:
+        case CIFS_SUPER_MAGIC:
+        case SMB2_SUPER_MAGIC:
+            return thefsprofiles[2];
+        case FUSE_SUPER_MAGIC:
+            return thefsprofiles[3];
+        case CEPH_SUPER_MAGIC:
+            return thefsprofiles[4];
+        default:
+            return thefsprofiles[0];
+    }
 }
 
-static void pagetofile(int &file, int page, int col, int row)
+static FSPROFILE *fsprofile(const std::string &name)
 {
-    file = row + therows*(col + thecols*page);
+    for (int i = 0; i < sizeof(thefsprofiles)/sizeof(thefsprofiles[0]); i++)
+    {
+        if (name == thefsprofiles[i].myname)
+            return &thefsprofiles[i];
+    }
+    return 0;
 }
 
-static void filetopage()
-{ filetopage(thecurfile, thecurpage, thecurcol, thecurrow); }
-static void pagetofile()
-{ pagetofile(thecurfile, thecurpage, thecurcol, thecurrow); }
+// The profile for the filesystem of the listed directory
+static const FSPROFILE *thefsprofile = &thefsprofiles[0];
 
-// Set the current file to the one matching the given name, if it exists
-static void find_and_set_curfile(const std::string &name)
+// The filesystem type of an open directory, or 0 (which picks the local
+// profile) if it can't be found
+static long fstype(DIR *dp)
+{
+    struct statfs fs;
+    return fstatfs(dirfd(dp), &fs) ? 0 : fs.f_type;
+}
+
+// An absolute path for a path relative to the cwd, with "." and ".."
+// resolved lexically
+static std::string absolute_path(const std::string &path)
 {
-    for (int file = 0; file < thefiles.size(); file++)
+    const std::string full = path[0] == '/' ? path :
+        std::string(thecwd) + "/" + path;
+
+    std::vector<std::string> parts;
+    std::istringstream iss(full);
+    std::string part;
+    while (std::getline(iss, part, '/'))
     {
-        if (name == thefiles[file].name())
+        if (part == "..")
         {
-            thecurfile = file;
-            filetopage();
-            break;
+            if (!parts.empty())
+                parts.pop_back();
         }
+        else if (!part.empty() && part != ".")
+            parts.push_back(part);
     }
+
+    std::string result;
+    for (auto it = parts.begin(); it != parts.end(); ++it)
+        result += "/" + *it;
+    return result.empty() ? "/" : result;
 }
 
-static void layout()
+// stat(2) through thefsguard. A timeout fails with ETIMEDOUT.
+static int guarded_stat(const std::string &path, struct stat &st)
 {
-    layout(thefiles, LINES-3, COLS);
+    struct RESULT {
+        struct stat st;
+        int ret;
+        int err;
+    };
+    std::shared_ptr<RESULT> result(new RESULT);
 
-    filetopage();
+    if (!thefsguard.run(absolute_path(path), [result, path]()
+            {
+                result->ret = stat(path.c_str(), &result->st);
+                result->err = errno;
+            }))
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
 
-    // Clear the screen for the next draw. This is for user-controlled redraw,
-    // which should clear any garbage left on the screen by background jobs.
-    clear();
+    st = result->st;
+    errno = result->err;
+    return result->ret;
 }
 
-static void rebuild()
+// chdir(2) through thefsguard. The directory is opened on the worker and
+// then entered with fchdir(), which doesn't look anything up. A timeout
+// fails with ETIMEDOUT.
+static int guarded_chdir(const char *dir)
 {
-    TIMER    timer(false);
-    double    buildtime;
-    double    sorttime;
-    double    layouttime;
-
-    // Set the hostname and username
-    gethostname(thehostname, BUFSIZE);
+    struct RESULT {
+        RESULT() : fd(-1), err(0), finished(false) {}
+        int fd;
+        int err;
+        // Set by whichever of the worker and a timeout comes first, so
+        // that the other closes the file descriptor
+        std::atomic<bool> finished;
+    };
+    std::shared_ptr<RESULT> result(new RESULT);
 
-    // Get the directory listing
-    if (!getcwd(thecwd, sizeof(thecwd)))
+    const std::string path = dir;
+    if (!thefsguard.run(absolute_path(path), [result, path]()
+            {
+                result->fd = open(path.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                result->err = errno;
+                if (result->finished.exchange(true) && result->fd >= 0)
+                    close(result->fd);
+            }))
     {
-        themsg = "Could not get current directory";
-        return;
+        if (result->finished.exchange(true) && result->fd >= 0)
+            close(result->fd);
+        errno = ETIMEDOUT;
+        return -1;
     }
 
-    DIR *dp = opendir(thecwd);
-    if (dp == NULL)
+    if (result->fd < 0)
     {
-        themsg = "Could not get directory listing";
-        return;
+        errno = result->err;
+        return -1;
     }
 
-    // Save the current file name
-    std::string prevfile;
-    if (thecurfile < thefiles.size())
-        prevfile = thefiles[thecurfile].name();
+    const int ret = fchdir(result->fd);
+    const int err = errno;
+    close(result->fd);
+    errno = err;
+    return ret;
+}
 
-    thefiles.clear();
+// A key pressed while a long operation (such as a rebuild of a huge
+// directory) runs on the UI thread stops it. Escape abandons the
+// operation, and any other key keeps what was done so far and is then
+// handled as usual.
+class INTERRUPT {
+public:
+    enum { NONE, KEEP, ABANDON };
 
-    const struct dirent *result = readdir(dp);
-    while(result)
+    INTERRUPT() : mystate(NONE) {}
+
+    // Check for a key. Returns whether the operation should stop.
+    bool poll()
     {
-        if (strcmp(result->d_name, ".") &&
-            strcmp(result->d_name, "..") &&
-            !ignored(result->d_name))
-        {
-            thefiles.push_back(DIRINFO());
-            thefiles.back().setname(result->d_name);
+        if (mystate != NONE || theheadless || isendwin())
+            return mystate != NONE;
 
-            if (result->d_type == DT_DIR)
-            {
-                thefiles.back().setdirectory();
-            }
-            else if (result->d_type == DT_UNKNOWN)
-            {
-                thefiles.back().setdirectory_from_stat();
-            }
+        const int c = getch();
+        if (c == ERR)
+            return false;
+        if (c == ESC)
+            mystate = ABANDON;
+        else
+        {
+            thepushedkey = c;
+            mystate = KEEP;
         }
-        result = readdir(dp);
+        return true;
     }
 
-    closedir(dp);
-
-    if (thedebugmode)
-        buildtime = timer.elapsed();
+    bool stopped() const { return mystate != NONE; }
+    bool abandoned() const { return mystate == ABANDON; }
 
-    std::sort(thefiles.begin(), thefiles.end());
+private:
+    int mystate;
+};
 
-    // Restore the current file if possible. This allows reordering (eg.
-    // toggling details or refreshing the directory) to preserve the
-    // selection.
-    if (!prevfile.empty())
-        find_and_set_curfile(prevfile);
+// Stat all entries using a few threads, since on network filesystems the
+// cost is almost entirely latency. The threads run under thefsguard, and
+// the entries they haven't reached if it times out are marked stale.
+// Returns false in that case, or if Escape abandons the stat calls. Other
+// keys let them finish, since the listing that is kept needs them.
+static bool parallel_stat(std::vector<DIRINFO> &dirs,
+                          INTERRUPT *interrupt = 0)
+{
+    const int chunk = 64;
+    const int n = dirs.size();
+    const int nthreads = SYSmin(thefsprofile->mythreads, n / chunk + 1);
+
+    // Shared with the threads, which may outlive a timeout. They only touch
+    // dirs under the lock, and not at all once it's cancelled.
+    struct WORK {
+        std::mutex lock;
+        std::vector<DIRINFO> *dirs;
+        bool cancelled;
+        std::atomic<int> next;
+        std::atomic<int> progress;
+    };
+    std::shared_ptr<WORK> work(new WORK);
+    work->dirs = &dirs;
+    work->cancelled = false;
+    work->next = 0;
+    work->progress = 0;
 
-    if (thecurfile >= thefiles.size())
-        thecurfile = thefiles.size() ? thefiles.size()-1 : 0;
+    auto stat_chunks = [work, n]()
+    {
+        TRACE_SCOPE trace("parallel_stat");
+        std::vector<std::string> names;
+        std::vector<struct stat> stats;
+        struct stat zero;
+        memset(&zero, 0, sizeof(zero));
+        int start;
+        while ((start = work->next.fetch_add(chunk)) < n)
+        {
+            int end = SYSmin(start + chunk, n);
+            {
+                std::lock_guard<std::mutex> lock(work->lock);
+                if (work->cancelled)
+                    return;
+                names.clear();
+                for (int i = start; i < end; i++)
+                    names.push_back((*work->dirs)[i].statpath());
+            }
 
-    if (thedebugmode)
-        sorttime = timer.elapsed();
+            // Use lstat rather than stat so that symbolic links are not
+            // followed, and we can get information about the link itself
+            stats.assign(end - start, zero);
+            // Progress is counted per call, so that a slow but live mount
+            // isn't taken for a dead one
+            for (int i = start; i < end; i++)
+            {
+                lstat(names[i-start].c_str(), &stats[i-start]);
+                thestatcalls++;
+                work->progress++;
+            }
 
-    layout();
+            std::lock_guard<std::mutex> lock(work->lock);
+            if (work->cancelled)
+                return;
+            for (int i = start; i < end; i++)
+                (*work->dirs)[i].setstat(stats[i-start]);
+        }
+    };
 
-    if (thedebugmode)
+    auto poll = [work, interrupt]()
     {
-        layouttime = timer.elapsed();
+        if (interrupt && interrupt->poll() && interrupt->abandoned())
+        {
+            std::lock_guard<std::mutex> lock(work->lock);
+            work->cancelled = true;
+        }
+    };
 
-        char buf[BUFSIZE];
-        sprintf(buf, "build time: %f sort time: %f layout time %f",
-                buildtime,
-                sorttime-buildtime,
-                layouttime-sorttime);
-        themsg = buf;
+    // The calling thread only waits, so that it never blocks in lstat()
+    bool done = thefsguard.run(thecwd, [stat_chunks, nthreads]()
+            {
+                std::vector<std::thread> threads;
+                for (int i = 0; i < nthreads; i++)
+                    threads.push_back(std::thread(stat_chunks));
+                for (auto it = threads.begin(); it != threads.end(); ++it)
+                    it->join();
+            }, &work->progress, poll);
+
+    std::lock_guard<std::mutex> lock(work->lock);
+    bool abandoned = work->cancelled;
+    work->cancelled = true;
+    if (abandoned)
+        return false;
+    if (!done)
+    {
+        for (auto it = dirs.begin(); it != dirs.end(); ++it)
+        {
+            if (!it->hasstat())
+                it->setstale();
+        }
     }
+    return done;
 }
 
-static void set_attrs(const DIRINFO &dir, bool curfile)
-{
-    if (curfile)
+// Background stat() requests for entries of thefiles. Requests are queued
+// in tiers by urgency (the current page, the adjacent pages, then the rest),
+// and the workers always serve the most urgent tier first. Results are
+// collected by the UI thread with take(), so that it never waits on lstat()
+// to draw a page.
+class STATQUEUE {
+public:
+    enum { TIERS = 3 };
+
+    struct RESULT {
+        int index;
+        struct stat st;
+    };
+
+    STATQUEUE()
+        : mylimit(STATTHREADS)
+        , mygeneration(0)
+        , myrequestedall(false)
+        , mystop(false)
     {
-        attrset(COLOR_PAIR(0));
-        attron(A_REVERSE);
+        for (int i = 0; i < TIERS; i++)
+            myactive[i] = 0;
     }
-    else
+    ~STATQUEUE()
     {
-        int color = 0; // Black
-        for (int i = 0; i < thecolors.size(); i++)
         {
-            switch (thecolors[i].mytype)
-            {
-                case COLOR::DIRECTORY:
-                    if (dir.isdirectory())
-                    {
-                        color = thecolors[i].mycolor;
-                    }
-                    break;
-                case COLOR::EXECUTABLE:
-                    if (!dir.isdirectory() && dir.isexecute())
-                    {
-                        color = thecolors[i].mycolor;
-                    }
-                    break;
-                case COLOR::READONLY:
-                    if (!dir.isdirectory() && !dir.iswrite())
-                    {
-                        color = thecolors[i].mycolor;
-                    }
-                    break;
-                case COLOR::LINK:
-                    if (dir.islink())
-                    {
-                        color = thecolors[i].mycolor;
-                    }
-                    break;
-                case COLOR::TAGGED:
-                    break;
-                case COLOR::PATTERN:
-                    if (!fnmatch(thecolors[i].mypattern.c_str(),
-                                dir.name().c_str(), FNM_PERIOD))
-                    {
-                        color = thecolors[i].mycolor;
-                    }
-                    break;
-            }
+            std::lock_guard<std::mutex> lock(mylock);
+            mystop = true;
+            mycond.notify_all();
         }
+        for (auto it = mythreads.begin(); it != mythreads.end(); ++it)
+            it->join();
+    }
 
-        attrset(COLOR_PAIR(color));
+    // Drop all requests and results, since the entries of thefiles have
+    // changed or been reordered. The workers then run as many stat calls at
+    // once as the filesystem's profile allows.
+    void reset()
+    {
+        const std::string mount = thefsguard.mount(thecwd);
+
+        std::lock_guard<std::mutex> lock(mylock);
+        mymount = mount;
+        mylimit = thefsprofile->mythreads;
+        mycond.notify_all();
+        mygeneration++;
+        for (int i = 0; i < TIERS; i++)
+            mytiers[i].clear();
+        mytier.clear();
+        myresults.clear();
+        myrequestedall = false;
     }
-}
 
-static void puttime(const char *format, struct tm &time)
-{
-    char date[BUFSIZE];
+    // Queue a stat of path for thefiles[index]. Requests for an entry that
+    // is already queued at the same or a more urgent tier are ignored.
+    void request(int index, const std::string &path, int tier)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        if (index >= mytier.size())
+            mytier.resize(index+1, TIERS);
+        if (mytier[index] <= tier)
+            return;
+        mytier[index] = tier;
+        mytiers[tier].push_back(REQUEST{index, path});
+
+        while ((int)mythreads.size() < mylimit)
+            mythreads.push_back(std::thread(&STATQUEUE::work, this));
+        mycond.notify_one();
+    }
 
-    strftime(date, BUFSIZE, format, &time);
-    attrset(A_NORMAL);
-    addnstr(date, BUFSIZE);
-}
+    // Whether everything has been requested since the last reset()
+    bool requestedall() const { return myrequestedall; }
+    void setrequestedall() { myrequestedall = true; }
 
-static void putpunc(char c)
-{
-    attrset(COLOR_PAIR(4));
-    addch(c);
-}
+    // Whether any requests are queued, running or not yet taken
+    bool busy()
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        if (!myresults.empty())
+            return true;
+        for (int i = 0; i < TIERS; i++)
+        {
+            if (!mytiers[i].empty() || myactive[i])
+                return true;
+        }
+        return false;
+    }
 
-static void drawfile(int file, const SPY_REGEX *incsearch)
-{
-    int page, x, y;
-    filetopage(file, page, x, y);
+    // Wait up to ms milliseconds for the most urgent tier to complete
+    void wait(int ms)
+    {
+        std::unique_lock<std::mutex> lock(mylock);
+        mydone.wait_for(lock, std::chrono::milliseconds(ms), [this]()
+                { return mytiers[0].empty() && !myactive[0]; });
+    }
 
-    int xoff = (x * COLS) / thecols;
+    // Move the results since the last call into results
+    void take(std::vector<RESULT> &results)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        results.swap(myresults);
+        myresults.clear();
+    }
 
-    const DIRINFO &dir = thefiles[file];
+private:
+    struct REQUEST {
+        int index;
+        std::string path;
+    };
 
-    // Draw details
-    switch (thedetail)
+    void work()
     {
-        case DETAIL_NONE:
+        // Each stretch of time that the worker is busy is traced
+        uint64_t busy = 0;
+
+        std::unique_lock<std::mutex> lock(mylock);
+        while (true)
+        {
+            int tier = 0;
+            while (tier < TIERS && mytiers[tier].empty())
+                tier++;
+            if (mystop)
+                return;
+
+            int active = 0;
+            for (int i = 0; i < TIERS; i++)
+                active += myactive[i];
+            if (tier == TIERS || active >= mylimit)
             {
-                // Draw the '*' for directories
-                set_attrs(dir, false);
-                if (dir.isdirectory())
-                {
-                    move(2+y, xoff);
-                    addch('*');
-                }
+                if (busy)
+                    TRACE::instance().record("statqueue", busy, TRACE::now());
+                busy = 0;
+
+                mycond.wait(lock);
+                continue;
             }
-            xoff += 2;
-            break;
-        case DETAIL_SIZE:
+            if (!busy)
+                busy = TRACE::now();
+
+            REQUEST req = mytiers[tier].front();
+            mytiers[tier].pop_front();
+
+            // Skip requests superseded by a more urgent tier
+            if (mytier[req.index] != tier)
+                continue;
+            mytier[req.index] = -1;
+
+            const int generation = mygeneration;
+            const std::string mount = mymount;
+            const int limit = mylimit;
+            myactive[tier]++;
+            lock.unlock();
+
+            // Wait for a stat slot on the mount, which workers left on it
+            // from an earlier listing may hold, but leave the entry without
+            // stat data rather than block on an unresponsive mount
+            RESULT result;
+            result.index = req.index;
+            memset(&result.st, 0, sizeof(result.st));
+            const bool reachable = thefsguard.acquirestat(mount, limit);
+            if (reachable)
             {
-                // Draw the file size. Blocks of 3 digits will alternate in
-                // color.
-                bool color = true;
-                int i = 0;
-                size_t s = dir.size();
-                do
-                {
-                    move(2+y, xoff+thedetailsizewidth-i-1);
-                    if (!(i % 3))
-                        color = !color;
-                    attrset(color ? COLOR_PAIR(4) : A_NORMAL);
-                    addch((s % 10) + '0');
-                    s /= 10;
-                    i++;
-                } while (s);
+                lstat(req.path.c_str(), &result.st);
+                thestatcalls++;
+                thefsguard.releasestat(mount);
             }
-            xoff += thedetailsizewidth+2;
-            break;
-        case DETAIL_TIME:
+
+            lock.lock();
+            myactive[tier]--;
+            if (generation == mygeneration && reachable)
             {
-                // Draw the modification time
-                time_t modtime = dir.modtime();
-                time_t nowtime = time(0);
-                time_t yestime = nowtime - 60*60*24;
-                struct tm modtm;
-                struct tm nowtm;
-                struct tm yestm;
+                if (myresults.empty())
+                    theevents.wake();
+                myresults.push_back(result);
+            }
+            mydone.notify_all();
+        }
+    }
 
-                localtime_r(&modtime, &modtm);
-                localtime_r(&nowtime, &nowtm);
-                localtime_r(&yestime, &yestm);
+    std::mutex mylock;
+    std::condition_variable mycond;
+    std::condition_variable mydone;
+    std::vector<std::thread> mythreads;
+    std::deque<REQUEST> mytiers[TIERS];
+    // The tier each entry is queued at, TIERS if not queued and -1 once
+    // started
+    std::vector<signed char> mytier;
+    std::vector<RESULT> myresults;
+    // The mount holding the listing, whose stat slots in thefsguard the
+    // workers take
+    std::string mymount;
+    // The number of workers that may stat at once
+    int mylimit;
+    int myactive[TIERS];
+    int mygeneration;
+    bool myrequestedall;
+    bool mystop;
+};
 
-                move(2+y, xoff);
+static STATQUEUE thestats;
 
-                if (nowtm.tm_mday == modtm.tm_mday &&
-                    nowtm.tm_mon == modtm.tm_mon &&
-                    nowtm.tm_year == modtm.tm_year)
-                {
-                    attrset(A_NORMAL);
-                    addstr("    Today");
-                }
-                else if (yestm.tm_mday == modtm.tm_mday &&
-                         yestm.tm_mon == modtm.tm_mon &&
-                         yestm.tm_year == modtm.tm_year)
-                {
-                    attrset(A_NORMAL);
-                    addstr("Yesterday");
-                }
-                else
-                {
-                    puttime("%b %d", modtm);
-                    putpunc('/');
-                    puttime("%g", modtm);
-                }
+// Reads the start of the highlighted file into the page cache once the
+// cursor has rested on it for DWELL milliseconds, so that opening it next
+// doesn't wait on a cold disk or network filesystem. A worker thread issues
+// readahead(2) in CHUNK pieces, and stops when the cursor moves on. The
+// whole session has a budget of bytes to prefetch.
+class PREFETCH {
+public:
+    static const int DWELL = 200;
+    static const uint64_t CHUNK = 256 << 10;
+
+    PREFETCH()
+        : mysize(0)
+        , mybudget(256 << 20)
+        , myused(0)
+        , mygeneration(0)
+        , mystop(false)
+        , myfiles(0)
+        , myopens(0)
+        , myhits(0)
+    {}
+    ~PREFETCH()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mylock);
+            mystop = true;
+            mycond.notify_all();
+        }
+        if (mythread.joinable())
+            mythread.join();
+    }
 
-                time_t difftime = nowtime - modtime;
-                if (difftime == 0)
-                {
-                    printw("      now", (int)difftime);
-                }
-                else if (difftime < 60)
-                {
-                    printw("      %03d", -(int)difftime);
-                }
-                else if (difftime < 3600)
-                {
-                    attrset(A_NORMAL);
-                    printw("   %3d", -(int)(difftime/60));
-                    putpunc(':');
-                    attrset(A_NORMAL);
-                    printw("%02d", (int)(difftime%60));
-                }
-                else
-                {
-                    puttime(" %k", modtm);
-                    putpunc(':');
-                    puttime("%M", modtm);
-                    putpunc(':');
-                    puttime("%S", modtm);
-                }
-            }
-            xoff += thedetailtimewidth+2;
-            break;
+    void setbudget(uint64_t bytes) { mybudget = bytes; }
+
+    // Prefetch the first size bytes of path (an absolute path) after the
+    // dwell, cancelling any other prefetch. Files are prefetched once.
+    void request(const std::string &path, uint64_t size)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        if (path == mylast || myfetched.count(path) || myused >= mybudget)
+            return;
+        mylast = path;
+        mypath = path;
+        mysize = size;
+        mygeneration++;
+        myrequesttime = std::chrono::steady_clock::now();
+
+        if (!mythread.joinable())
+            mythread = std::thread(&PREFETCH::work, this);
+        mycond.notify_one();
+    }
+
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        mylast.clear();
+        if (mypath.empty())
+            return;
+        mypath.clear();
+        mygeneration++;
+        mycond.notify_one();
     }
 
-    move(2+y, xoff);
+    // Count the opening of a file, which is a hit if it was prefetched
+    void opened(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        myopens++;
+        if (myfetched.count(path))
+            myhits++;
+    }
 
-    int maxlen = SYSmax(COLS - xoff, 0);
-    int hlstart;
-    int hlend;
-    if (dir.match(incsearch, hlstart, hlend) &&
-            (HLSEARCH || file == thecurfile))
+    // Files prefetched, files opened and how many of those were prefetched,
+    // and the bytes used of the budget
+    void counts(int &files, int &opens, int &hits, uint64_t &used)
     {
-        set_attrs(dir, file == thecurfile);
+        std::lock_guard<std::mutex> lock(mylock);
+        files = myfiles;
+        opens = myopens;
+        hits = myhits;
+        used = myused;
+    }
 
-        addnstr(dir.name().c_str(), SYSmin(hlstart, maxlen));
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mylock);
+        while (!mystop)
+        {
+            if (mypath.empty())
+            {
+                mycond.wait(lock);
+                continue;
+            }
 
-        attrset(COLOR_PAIR(8));
-        attron(A_REVERSE);
-        addnstr(dir.name().c_str() + hlstart,
-                SYSmax(SYSmin(hlend - hlstart, maxlen - hlstart), 0));
+            // Wait out the dwell, restarting it if the cursor moves
+            const int generation = mygeneration;
+            if (mycond.wait_until(lock, myrequesttime +
+                        std::chrono::milliseconds(DWELL), [&]()
+                        { return mystop || mygeneration != generation; }))
+                continue;
 
-        set_attrs(dir, file == thecurfile);
+            const std::string path = mypath;
+            const uint64_t size = mysize;
+            lock.unlock();
+            const bool done = fetch(path, size, generation);
+            lock.lock();
 
-        addnstr(dir.name().c_str() + hlend,
-                SYSmax(SYSmin(dir.name().length() - hlend, maxlen - hlend), 0));
+            if (done)
+            {
+                myfetched.insert(path);
+                myfiles++;
+            }
+            if (mygeneration == generation)
+                mypath.clear();
+        }
     }
-    else
+
+    // Returns true if the start of the file was read in full
+    bool fetch(const std::string &path, uint64_t size, int generation)
     {
-        set_attrs(dir, file == thecurfile);
-        addnstr(dir.name().c_str(), maxlen);
-    }
+        TRACE_SCOPE trace("prefetch");
+        const std::string mount = thefsguard.mount(path);
+        if (!thefsguard.acquire(mount))
+            return false;
 
-    set_attrs(dir, false);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0)
+        {
+            thefsguard.release(mount);
+            return false;
+        }
 
-    move(2+y, xoff-1);
-}
+        struct stat st;
+        uint64_t len = 0;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+            len = std::min((uint64_t)st.st_size, size);
 
-static void draw(const SPY_REGEX *incsearch = 0)
-{
-    char    title[BUFSIZE];
+        uint64_t off = 0;
+        while (off < len && mygeneration == generation)
+        {
+            const uint64_t n = std::min(CHUNK, len - off);
+            if (myused + n > mybudget)
+                break;
+            if (readahead(fd, off, n))
+                posix_fadvise(fd, off, n, POSIX_FADV_WILLNEED);
+            myused += n;
+            off += n;
+        }
 
-    // Use erase() to clear the screen before drawing. Don't use clear(),
-    // since this will cause the next refresh() to clear the screen causing
-    // flicker.
-    erase();
+        close(fd);
+        thefsguard.release(mount);
+        return len && off == len;
+    }
 
-    attrset(A_NORMAL);
+    std::mutex mylock;
+    std::condition_variable mycond;
+    std::thread mythread;
+    // The last file requested, and the file waiting or being prefetched
+    std::string mylast;
+    std::string mypath;
+    uint64_t mysize;
+    std::chrono::steady_clock::time_point myrequesttime;
+    std::set<std::string> myfetched;
+    std::atomic<uint64_t> mybudget;
+    std::atomic<uint64_t> myused;
+    std::atomic<int> mygeneration;
+    bool mystop;
+    int myfiles;
+    int myopens;
+    int myhits;
+};
 
-    move(0, 0);
-    int rval = snprintf(title, BUFSIZE, "%s@%s: %s", s_user, thehostname, thecwd);
-    assert(rval >= 0);
-    addnstr(title, COLS);
+static PREFETCH theprefetch;
 
-    if (!themsg.empty())
+// Names of user and group ids, looked up on a worker thread since each
+// lookup can take milliseconds when it goes to a directory service (such as
+// LDAP through SSSD). The names are kept for the life of the process. The
+// main loop is woken as they arrive.
+class IDNAMES {
+public:
+    enum KIND { USER, GROUP };
+
+    IDNAMES() : mygeneration(0), mystop(false) {}
+    ~IDNAMES()
     {
-        move(LINES-1, 0);
-        attrset(A_REVERSE);
-        addnstr(themsg.c_str(), COLS-1);
-        attrset(A_NORMAL);
+        {
+            std::lock_guard<std::mutex> lock(mylock);
+            mystop = true;
+            mycond.notify_all();
+        }
+        if (mythread.joinable())
+            mythread.join();
     }
 
-    if (thefiles.size())
+    // Get the name of an id. If it hasn't been looked up yet, a lookup is
+    // queued, name is set to the number and false is returned.
+    bool name(KIND kind, unsigned id, std::string &name)
     {
-        if (thepages > 1)
+        std::lock_guard<std::mutex> lock(mylock);
+        auto it = mynames[kind].find(id);
+        if (it != mynames[kind].end())
         {
-            move(1, 0);
-            printw("Page %d/%d", thecurpage+1, thepages);
+            name = it->second;
+            return true;
         }
 
-        int file = thecurpage * thecols * therows;
-        int maxfile = SYSmin((thecurpage+1) * thecols * therows, thefiles.size());
-        for (; file < maxfile; file++)
+        name = std::to_string(id);
+        if (mypending[kind].insert(id).second)
         {
-            if (file != thecurfile)
-                drawfile(file, incsearch);
+            myqueue.push_back(std::make_pair(kind, id));
+            if (!mythread.joinable())
+                mythread = std::thread(&IDNAMES::work, this);
+            mycond.notify_one();
         }
-
-        // Draw the current file last to leave the cursor in the expected
-        // place
-        drawfile(thecurfile, incsearch);
+        return false;
     }
-    else
+
+    // Counts the names that have arrived, so that rows showing a number in
+    // place of a name can tell when to be composed again
+    int generation() const { return mygeneration; }
+
+    // Whether any lookups are queued or running
+    bool busy()
     {
-        move(1, 0);
-        printw("<empty>\n");
+        std::lock_guard<std::mutex> lock(mylock);
+        return !mypending[USER].empty() || !mypending[GROUP].empty();
     }
-}
 
-static void ignoretoggle(const char *label)
-{
-    IGNOREMASK &mask = theignoremask[label];
-    mask.myenable = !mask.myenable;
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mylock);
+        while (!mystop)
+        {
+            if (myqueue.empty())
+            {
+                mycond.wait(lock);
+                continue;
+            }
 
-    rebuild();
+            const std::pair<KIND, unsigned> req = myqueue.front();
+            myqueue.pop_front();
+            lock.unlock();
 
-    themsg = mask.myenable ? "Enabled" : "Disabled";
-    themsg += " ignore mask '";
-    themsg += label;
-    themsg += "'";
-}
+            std::string name;
+            {
+                TRACE_SCOPE trace("idname");
+                name = lookup(req.first, req.second);
+            }
 
-static void detailtoggle()
-{
-    thedetail = (DETAIL_TYPE)((int)thedetail+1);
-    if (thedetail == DETAIL_MAX)
-        thedetail = DETAIL_NONE;
+            lock.lock();
+            mynames[req.first][req.second] = name;
+            mypending[req.first].erase(req.second);
+            mygeneration++;
 
-    rebuild();
+            // Wake the main loop once for a batch of lookups
+            if (myqueue.empty())
+                theevents.wake();
+        }
+    }
 
-    switch (thedetail)
+    // The name for an id, or the number if it has none
+    static std::string lookup(KIND kind, unsigned id)
     {
-        case DETAIL_NONE: break;
-        case DETAIL_SIZE: themsg = "Sorted by file size"; break;
-        case DETAIL_TIME: themsg = "Sorted by modification time"; break;
+        std::vector<char> buf(4096);
+        while (true)
+        {
+            int err;
+            const char *name = 0;
+            if (kind == USER)
+            {
+                struct passwd pw, *result = 0;
+                err = getpwuid_r(id, &pw, &buf[0], buf.size(), &result);
+                if (result)
+                    name = result->pw_name;
+            }
+            else
+            {
+                struct group gr, *result = 0;
+                err = getgrgid_r(id, &gr, &buf[0], buf.size(), &result);
+                if (result)
+                    name = result->gr_name;
+            }
+
+            if (err == ERANGE && buf.size() < (1 << 20))
+            {
+                buf.resize(buf.size() * 2);
+                continue;
+            }
+            return name ? name : std::to_string(id);
+        }
     }
-}
 
-static void debugmode()
-{
-    thedebugmode = !thedebugmode;
+    std::mutex mylock;
+    std::condition_variable mycond;
+    std::thread mythread;
+    std::map<unsigned, std::string> mynames[2];
+    std::set<unsigned> mypending[2];
+    std::deque<std::pair<KIND, unsigned>> myqueue;
+    std::atomic<int> mygeneration;
+    bool mystop;
+};
 
-    themsg = thedebugmode ? "Enabled" : "Disabled";
-    themsg += " debug mode";
-}
+static IDNAMES theidnames;
 
-static int ncols()
+// Whether quitting must skip waiting for threads blocked on a dead mount,
+// or on a name service lookup
+static bool fs_stuck()
 {
-    if (thecurpage < thepages-1)
-        return thecols;
-
-    int files = thefiles.size() - thecurpage*thecols*therows;
-    return (files + therows - 1 - thecurrow) / therows;
+    return thefsguard.busy() || theidnames.busy();
 }
 
-static int nrows()
-{
-    if (thecurpage < thepages-1)
-        return therows;
-
-    int files = thefiles.size() - thecurpage*thecols*therows;
-    files -= thecurcol * therows;
-    if (files >= therows)
-        return therows;
-    if (files < 0)
-        return 0;
-    return files;
-}
+// Metadata query, eg. "size>1G mtime>30d type=f". Each clause is
+// field, operator ('<', '>' or '='), value, and all clauses must match. A
+// clause prefixed with '!' is negated. Fields:
+//   size   bytes, with an optional k/M/G/T suffix
+//   mtime  age since modification, with an s/m/h/d/w suffix
+//   type   f (file), d (directory), l (link), p (pipe), s (socket)
+//   perm   r/w/x for the user permission bits, or octal for an exact match
+//   name   glob pattern
+// Clauses are evaluated one column at a time over batches of entries rather
+// than one entry at a time.
+class QUERY {
+public:
+    bool compile(const std::string &query, std::string &err)
+    {
+        myclauses.clear();
 
-static void left()
-{
-    thecurcol--;
-    if (thecurcol < 0)
-        thecurcol = ncols()-1;
-    pagetofile();
-}
+        std::istringstream iss(query);
+        std::string word;
+        while (iss >> word)
+        {
+            CLAUSE clause;
+            clause.negate = word[0] == '!';
+            if (clause.negate)
+                word.erase(0, 1);
 
-static void right()
-{
-    thecurcol++;
-    if (thecurcol >= ncols())
-        thecurcol = 0;
-    pagetofile();
-}
+            size_t oppos = word.find_first_of("<>=");
+            if (oppos == std::string::npos || oppos+1 == word.length())
+            {
+                err = "Expected <field><op><value> in '" + word + "'";
+                return false;
+            }
 
-static void up()
-{
-    thecurrow--;
-    if (thecurrow < 0)
-        thecurrow = nrows()-1;
-    pagetofile();
-}
+            std::string field = word.substr(0, oppos);
+            std::string value = word.substr(oppos+1);
+            clause.op = word[oppos];
+            clause.value = 0;
 
-static void down()
-{
-    thecurrow++;
-    if (thecurrow >= nrows())
-        thecurrow = 0;
-    pagetofile();
-}
+            bool ok = true;
+            if (field == "size")
+            {
+                static const int64_t scale[] = {1024, 1024, 1024, 1024};
+                clause.field = SIZE;
+                ok = parse_scaled(value, "kMGT", scale, clause.value);
+            }
+            else if (field == "mtime")
+            {
+                static const int64_t scale[] = {1, 60, 60, 24, 7};
+                clause.field = MTIME;
+                ok = parse_scaled(value, "smhdw", scale, clause.value);
+            }
+            else if (field == "type")
+            {
+                clause.field = TYPE;
+                ok = clause.op == '=' && value.length() == 1;
+                switch (value[0])
+                {
+                    case 'f': clause.value = S_IFREG; break;
+                    case 'd': clause.value = S_IFDIR; break;
+                    case 'l': clause.value = S_IFLNK; break;
+                    case 'p': clause.value = S_IFIFO; break;
+                    case 's': clause.value = S_IFSOCK; break;
+                    default: ok = false; break;
+                }
+            }
+            else if (field == "perm")
+            {
+                clause.field = PERM;
+                ok = clause.op == '=';
+                if (isdigit(value[0]))
+                {
+                    char *end;
+                    clause.value = strtol(value.c_str(), &end, 8);
+                    ok = ok && !*end;
+                }
+                else
+                {
+                    // Symbolic permissions only require the bits to be set
+                    clause.op = '&';
+                    for (auto it = value.begin(); ok && it != value.end(); ++it)
+                    {
+                        switch (*it)
+                        {
+                            case 'r': clause.value |= S_IRUSR; break;
+                            case 'w': clause.value |= S_IWUSR; break;
+                            case 'x': clause.value |= S_IXUSR; break;
+                            default: ok = false; break;
+                        }
+                    }
+                }
+            }
+            else if (field == "name")
+            {
+                clause.field = NAME;
+                clause.pattern = value;
+                ok = clause.op == '=';
+            }
+            else
+            {
+                err = "Unknown field '" + field + "'";
+                return false;
+            }
 
-static bool spy_chdir(const char *dir)
-{
-    if (chdir(dir))
-    {
-        char    buf[BUFSIZE];
-        themsg = strerror_r(errno, buf, BUFSIZE);
-        return false;
-    }
+            if (!ok)
+            {
+                err = "Invalid clause '" + word + "'";
+                return false;
+            }
 
-    // Check if the directory really changed before invoking rebuild(),
-    // since special characters like '.' are handled directly by chdir.
-    char cwd[FILENAME_MAX];
-    if (!getcwd(cwd, sizeof(cwd)) || !strcmp(cwd, thecwd))
-        return false;
+            myclauses.push_back(clause);
+        }
 
-    // Save the current file
-    if (thecurfile < thefiles.size())
-        thesavedcurfile[thecwd] = thefiles[thecurfile].name();
+        // Evaluate the cheap numeric clauses first, so that fewer names
+        // need to be matched
+        std::stable_sort(myclauses.begin(), myclauses.end(),
+                [](const CLAUSE &a, const CLAUSE &b)
+                { return a.field != NAME && b.field == NAME; });
 
-    // Save a copy of the directory name that we were just in (for
-    // ".." handling below)
-    std::string prevdir = thecwd;
-    std::string prevparent;
-    const size_t slashpos = prevdir.rfind('/');
-    if (slashpos != std::string::npos)
-    {
-        prevparent = prevdir.substr(0, slashpos);
-        prevdir = prevdir.substr(slashpos+1, prevdir.length()-slashpos-1);
+        return true;
     }
 
-    rebuild();
+    bool empty() const { return myclauses.empty(); }
+    void clear() { myclauses.clear(); }
 
-    if (!strcmp(dir, "..") ||
-        !strcmp(dir, prevparent.c_str()))
-    {
-        // Special case for ".." - in this case, I would like to see
-        // the directory that we just came from as the current file.
-        find_and_set_curfile(prevdir);
-    }
-    else
+    // Set mask[i] for each entry that matches the query
+    void evaluate(const std::vector<DIRINFO> &dirs, std::vector<char> &mask) const
     {
-        // Restore the previous file, if it existed
-        auto it = thesavedcurfile.find(cwd);
-        if (it != thesavedcurfile.end())
-            find_and_set_curfile(it->second);
-    }
+        const int batch = 1024;
+        const int n = dirs.size();
+        const int64_t now = time(0);
+        int64_t column[batch];
 
-    return true;
-}
+        mask.assign(n, 1);
 
-static bool spy_jump_dir(const char *dir)
-{
-    std::string expanded = dir;
+        for (int start = 0; start < n; start += batch)
+        {
+            const int count = SYSmin(batch, n - start);
+            const DIRINFO *dir = &dirs[start];
+            char *m = &mask[start];
 
-    wordexp_t p;
-    if (!wordexp(dir, &p, 0))
+            for (auto it = myclauses.begin(); it != myclauses.end(); ++it)
+            {
+                const CLAUSE &clause = *it;
+
+                // Extract the column for this batch
+                switch (clause.field)
+                {
+                    case SIZE:
+                        for (int i = 0; i < count; i++)
+                            column[i] = dir[i].size();
+                        break;
+                    case MTIME:
+                        for (int i = 0; i < count; i++)
+                            column[i] = now - dir[i].modtime();
+                        break;
+                    case TYPE:
+                        for (int i = 0; i < count; i++)
+                            column[i] = dir[i].mode() & S_IFMT;
+                        break;
+                    case PERM:
+                        for (int i = 0; i < count; i++)
+                            column[i] = dir[i].mode() & 07777;
+                        break;
+                    case NAME:
+                        for (int i = 0; i < count; i++)
+                        {
+                            column[i] = m[i] && !fnmatch(clause.pattern.c_str(),
+                                    dir[i].name().c_str(), FNM_PERIOD);
+                        }
+                        break;
+                }
+
+                // Compare the column against the clause value
+                const int64_t value = clause.value;
+                const char negate = clause.negate;
+                switch (clause.field == NAME ? 'n' : clause.op)
+                {
+                    case '<':
+                        for (int i = 0; i < count; i++)
+                            m[i] &= (column[i] < value) ^ negate;
+                        break;
+                    case '>':
+                        for (int i = 0; i < count; i++)
+                            m[i] &= (column[i] > value) ^ negate;
+                        break;
+                    case '=':
+                        for (int i = 0; i < count; i++)
+                            m[i] &= (column[i] == value) ^ negate;
+                        break;
+                    case '&':
+                        for (int i = 0; i < count; i++)
+                            m[i] &= ((column[i] & value) == value) ^ negate;
+                        break;
+                    case 'n':
+                        for (int i = 0; i < count; i++)
+                            m[i] &= (column[i] != 0) ^ negate;
+                        break;
+                }
+            }
+        }
+    }
+
+private:
+    enum FIELD { SIZE, MTIME, TYPE, PERM, NAME };
+
+    struct CLAUSE {
+        FIELD field;
+        char op;
+        int64_t value;
+        std::string pattern;
+        bool negate;
+    };
+
+    // Parse a number with an optional unit suffix from units. Each unit is
+    // the previous one (or 1 for the first) multiplied by its scale.
+    static bool parse_scaled(const std::string &str, const char *units,
+            const int64_t *scale, int64_t &value)
     {
-        // Use the first valid expansion
-        for (int i = 0; i < p.we_wordc; i++)
+        char *end;
+        value = strtoll(str.c_str(), &end, 10);
+        if (end == str.c_str() || (*end && end[1]))
+            return false;
+        if (!*end)
+            return true;
+
+        int64_t mult = 1;
+        for (int i = 0; units[i]; i++)
         {
-            if (p.we_wordv[i])
+            mult *= scale[i];
+            if (units[i] == *end)
             {
-                expanded = p.we_wordv[i];
+                value *= mult;
+                return true;
             }
         }
-        wordfree(&p);
+        return false;
     }
 
-    return spy_chdir(expanded.c_str());
-}
+    std::vector<CLAUSE> myclauses;
+};
 
-static void jump_dir(const char *dir)
-{
-    spy_jump_dir(dir);
+// Content search for a literal pattern. One thread walks the directory
+// (or tree) and queues regular files, while a pool of threads maps each file
+// and scans it with memchr() for the first byte of the pattern. Matches are
+// collected under a lock and handed to the UI through take().
+class GREP {
+public:
+    struct MATCH {
+        std::string path;
+        int line;
+        std::string text;
+    };
 
-    draw();
-    refresh();
-}
+    GREP(const std::string &pattern, bool recursive)
+        : mypattern(pattern)
+        , myrecursive(recursive)
+        , mywalkdone(false)
+        , mynmatches(0)
+        , mycancel(false)
+        , mytruncated(false)
+        , mysearched(0)
+    {
+        // Take a copy of the enabled ignore patterns, since the masks may
+        // be toggled while the search runs
+        for (auto it = theignoremask.begin(); it != theignoremask.end(); ++it)
+        {
+            if (it->second.myenable)
+            {
+                myignore.insert(myignore.end(),
+                        it->second.mypatterns.begin(),
+                        it->second.mypatterns.end());
+            }
+        }
 
-static void dirup()
-{
-    if (!spy_chdir(".."))
+        const int nthreads = SYSmax(std::thread::hardware_concurrency(), 2);
+        myrunning = nthreads;
+
+        mythreads.push_back(std::thread(&GREP::walk, this));
+        for (int i = 0; i < nthreads; i++)
+            mythreads.push_back(std::thread(&GREP::search, this));
+    }
+    ~GREP()
     {
-        themsg = "No parent directory";
+        cancel();
+        wait();
     }
-}
-
-enum PROMPT_TYPE {
-    // Stay in curses mode after executing the command. If there was
-    // output, it won't be visible. This mode should only be used for
-    // commands that don't require user input.
-    PROMPT_SILENT,
 
-    // Leave curses mode to show output, but return to curses mode
-    // immediately after the command completes. This allows for interactive
-    // commands to use the terminal but to return immediately to curses
-    // mode when they complete.
-    PROMPT_INTERACTIVE,
+    // Wait for all threads to exit
+    void wait()
+    {
+        for (auto it = mythreads.begin(); it != mythreads.end(); ++it)
+            it->join();
+        mythreads.clear();
+    }
 
-    // Leave curses mode and wait for input before returning to curses
-    // mode. This mode shows the 'continue' prompt in termcap, without
-    // returning to curses mode - so that the command output is visible
-    // even after the command completes.
-    PROMPT_CONTINUE
-};
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        mycancel = true;
+        mycond.notify_all();
+    }
 
-template <PROMPT_TYPE> static void execute_command(const char *);
+    const std::string &pattern() const { return mypattern; }
+    bool done() const { return !myrunning; }
+    bool cancelled() const { return mycancel && !mytruncated; }
+    bool truncated() const { return mytruncated; }
+    int searched() const { return mysearched; }
 
-static void dirdown_enter()
-{
-    if (!spy_chdir(thefiles[thecurfile].name().c_str()))
+    // Move the matches found since the last call into matches
+    void take(std::vector<MATCH> &matches)
     {
-        themsg.clear();
-        std::string cmd = s_editor ? s_editor : "vim";
-        cmd += " %";
-        execute_command<PROMPT_SILENT>(cmd.c_str());
+        std::lock_guard<std::mutex> lock(mylock);
+        matches.swap(mymatches);
+        mymatches.clear();
     }
-}
 
-static void dirdown_display()
-{
-    if (!spy_chdir(thefiles[thecurfile].name().c_str()))
+private:
+    // Stop searching after this many matches
+    static const int MAXMATCHES = 100000;
+
+    // Longest line of context kept for a match
+    static const int MAXTEXT = 120;
+
+    bool skip(const char *name) const
     {
-        themsg.clear();
-        std::string cmd = s_pager ? s_pager : "less";
-        cmd += " %";
-        execute_command<PROMPT_SILENT>(cmd.c_str());
+        for (auto it = myignore.begin(); it != myignore.end(); ++it)
+        {
+            if (!fnmatch(it->c_str(), name, FNM_PERIOD))
+                return true;
+        }
+        return false;
     }
-}
 
-static void pageup()
-{
-    if (thecurpage > 0)
+    void walk()
     {
-        thecurpage--;
-        thecurfile -= therows * thecols;
+        TRACE_SCOPE trace("grep.walk");
+        walkdir(std::string());
+
+        std::lock_guard<std::mutex> lock(mylock);
+        mywalkdone = true;
+        mycond.notify_all();
     }
-}
-static void pagedown()
-{
-    if (thecurpage < thepages-1)
+
+    void walkdir(const std::string &prefix)
     {
-        thecurpage++;
-        thecurfile += therows * thecols;
-        if (thecurfile >= thefiles.size())
+        DIR *dp = opendir(prefix.empty() ? "." : prefix.c_str());
+        if (!dp)
+            return;
+
+        const struct dirent *result;
+        while (!mycancel && (result = readdir(dp)))
         {
-            thecurfile = thefiles.size()-1;
-            filetopage();
+            if (!strcmp(result->d_name, ".") ||
+                !strcmp(result->d_name, "..") ||
+                skip(result->d_name))
+                continue;
+
+            std::string path = prefix + result->d_name;
+
+            unsigned char type = result->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (lstat(path.c_str(), &st))
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR :
+                       S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            // Symbolic links are not followed, to avoid cycles
+            if (type == DT_DIR)
+            {
+                if (myrecursive)
+                    walkdir(path + "/");
+            }
+            else if (type == DT_REG)
+            {
+                std::lock_guard<std::mutex> lock(mylock);
+                mypaths.push_back(path);
+                mycond.notify_one();
+            }
         }
-    }
-}
 
-static void firstfile()
-{
-    thecurfile = 0;
-    filetopage();
-}
+        closedir(dp);
+    }
 
-static void lastfile()
-{
-    thecurfile = thefiles.size() ? thefiles.size()-1 : 0;
-    filetopage();
-}
+    void search()
+    {
+        TRACE_SCOPE trace("grep.search");
+        while (true)
+        {
+            std::string path;
+            {
+                std::unique_lock<std::mutex> lock(mylock);
+                while (!mycancel && mypaths.empty() && !mywalkdone)
+                    mycond.wait(lock);
 
-static void take()
-{
-    themsg = "take not implemented";
-}
+                if (mycancel || mypaths.empty())
+                    break;
 
-static void setenv()
-{
-    themsg = "setenv not implemented";
-}
+                path = mypaths.front();
+                mypaths.pop_front();
+            }
 
-static void ignore()
-{
-}
+            scan(path);
+            mysearched++;
+        }
 
-static int spy_getchar()
-{
-    int ch;
+        if (!--myrunning)
+            theevents.wake();
+    }
 
-    if (isendwin())
+    void scan(const std::string &path)
     {
-        // Set raw mode for stdin temporarily so that we can read a single
-        // character of unbuffered input.
-        struct termios old_settings;
-        struct termios new_settings;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
 
-        tcgetattr(0, &old_settings);
+        struct stat st;
+        if (fstat(fd, &st) || st.st_size < (off_t)mypattern.length() ||
+                mypattern.empty())
+        {
+            close(fd);
+            return;
+        }
 
-        new_settings = old_settings;
-        cfmakeraw (&new_settings);
-        tcsetattr (0, TCSANOW, &new_settings);
+        const size_t size = st.st_size;
+        void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return;
 
-        ch = getchar();
+        madvise(map, size, MADV_SEQUENTIAL);
 
-        tcsetattr (0, TCSANOW, &old_settings);
+        const char *data = (const char *)map;
+        const char *end = data + size;
 
-        if (ch == '\n' || ch == '\r')
-            ch = '\n';
+        // Skip binary files
+        if (memchr(data, '\0', SYSmin(size, 4096)))
+        {
+            munmap(map, size);
+            return;
+        }
 
-        // Hack to allow the arrow keys and delete to work in vi insert mode.
-        // Unfortunately, this breaks ESC (you have to hit it twice)
-        if (ch == ESC && rl_editing_mode == 0)
+        const char *pat = mypattern.c_str();
+        const size_t patlen = mypattern.length();
+
+        std::vector<MATCH> matches;
+
+        // Line numbers are counted lazily, only up to each match
+        int line = 1;
+        const char *counted = data;
+
+        const char *p = data;
+        while (!mycancel && end - p >= (ptrdiff_t)patlen)
         {
-            int ch2 = getchar();
-            if (ch2 == '[')
+            const char *hit = (const char *)memchr(p, pat[0], end - p - patlen + 1);
+            if (!hit)
+                break;
+
+            if (memcmp(hit+1, pat+1, patlen-1))
             {
-                int ch3 = getchar();
-                switch (ch3)
-                {
-                    case 'A':
-                        ch = KEY_UP; break;
-                    case 'B':
-                        ch = KEY_DOWN; break;
-                    case 'C':
-                        ch = KEY_RIGHT; break;
-                    case 'D':
-                        ch = KEY_LEFT; break;
-                    case '3':
-                        {
-                            int ch4 = getchar();
-                            if (ch4 == '~')
-                            {
-                                ch = KEY_DC;
-                                break;
-                            }
-                            ungetc(ch4, stdin);
-                        }
-                    default:
-                        ungetc(ch3, stdin);
-                        ungetc(ch2, stdin);
-                        break;
-                }
+                p = hit+1;
+                continue;
             }
-            else
+
+            const char *linestart = counted;
+            const char *nl;
+            while ((nl = (const char *)memchr(counted, '\n', hit - counted)))
             {
-                ungetc(ch2, stdin);
+                line++;
+                counted = nl+1;
+                linestart = counted;
             }
-        }
-    }
-    else
-    {
-        // Curses input
-        ch = getch();
-    }
-
-    return ch;
-}
 
-// Hackery to keep track of whether we're in vi command mode, since
-// readline does not provide this state flag.
-static bool thecommandmode = false;
+            const char *lineend = (const char *)memchr(hit, '\n', end - hit);
+            if (!lineend)
+                lineend = end;
 
-static int spy_rl_getc(FILE *fp)
-{
-    int key = spy_getchar();
+            // Keep a readable excerpt of the line
+            while (linestart < hit && isspace((unsigned char)*linestart))
+                linestart++;
 
-    switch (key)
-    {
-        case '\b':
-        case KEY_BACKSPACE:
-        case RUBOUT:
-            if (!rl_point)
+            MATCH match;
+            match.path = path;
+            match.line = line;
+            match.text.assign(linestart,
+                    SYSmin(lineend - linestart, MAXTEXT));
+            for (auto it = match.text.begin(); it != match.text.end(); ++it)
             {
-                // Backspace past the prompt cancels the command in spy
-                *rl_line_buffer = '\0';
-                key = EOF;
+                if (iscntrl((unsigned char)*it))
+                    *it = ' ';
             }
-            else
+            matches.push_back(match);
+
+            // Only report each line once
+            if (lineend == end)
+                break;
+            p = counted = lineend+1;
+            line++;
+        }
+
+        munmap(map, size);
+
+        if (!matches.empty())
+        {
+            std::lock_guard<std::mutex> lock(mylock);
+            if (mymatches.empty())
+                theevents.wake();
+            mymatches.insert(mymatches.end(), matches.begin(), matches.end());
+            mynmatches += matches.size();
+            if (mynmatches >= MAXMATCHES)
             {
-                key = '\b'; // Backspace character
+                mytruncated = true;
+                mycancel = true;
+                mycond.notify_all();
             }
-            break;
+        }
+    }
 
-        case ERR:
-            key = 0;
-            break;
+    std::string mypattern;
+    bool myrecursive;
+    std::vector<std::string> myignore;
+
+    std::vector<std::thread> mythreads;
+    std::mutex mylock;
+    std::condition_variable mycond;
+
+    // Protected by mylock
+    std::deque<std::string> mypaths;
+    std::vector<MATCH> mymatches;
+    bool mywalkdone;
+    int mynmatches;
+
+    std::atomic<bool> mycancel;
+    std::atomic<bool> mytruncated;
+    std::atomic<int> mysearched;
+    std::atomic<int> myrunning;
+};
+
+// What thefiles holds. Content search results replace the directory
+// listing until the next rebuild().
+enum LISTING_TYPE {
+    LISTING_DIRECTORY,
+    LISTING_GREP
+};
+
+static LISTING_TYPE thelisting = LISTING_DIRECTORY;
+static std::unique_ptr<GREP> thegrep;
+static std::string thegreppattern;
+
+// Shell builtins, which must be run by the shell even when the command is
+// otherwise simple enough to execute directly
+static const char *s_builtins[] = {
+    "cd", "pushd", "popd", "dirs", ".", "source", "exec", "eval", "export",
+    "unset", "set", "alias", "unalias", "umask", "ulimit", "exit", "builtin",
+    "command", "type", "hash", "read", "wait", "trap", "shopt", "jobs", "fg",
+    "bg", "history", "fc", "declare", "typeset", "local", "let", "shift",
+    "times", "setenv", "unsetenv", "rehash", 0
+};
+
+// Split a command into its arguments if it can be executed without a shell:
+// words separated by whitespace, quoted with '' or \, and nothing that the
+// shell would expand, redirect or interpret itself.
+static bool split_command(const std::string &command,
+                          std::vector<std::string> &args)
+{
+    std::string word;
+    bool        inword = false;
+
+    for (size_t i = 0; i < command.length(); i++)
+    {
+        const char c = command[i];
+        if (c == '\\')
+        {
+            if (++i == command.length() || command[i] == '\n')
+                return false;
+            word += command[i];
+            inword = true;
+        }
+        else if (c == '\'')
+        {
+            size_t end = command.find('\'', i+1);
+            if (end == std::string::npos)
+                return false;
+            word.append(command, i+1, end-i-1);
+            i = end;
+            inword = true;
+        }
+        else if (c == ' ' || c == '\t')
+        {
+            if (inword)
+                args.push_back(word);
+            word.clear();
+            inword = false;
+        }
+        else if (strchr("|&;<>()$`\"*?[]{}!\n", c))
+        {
+            return false;
+        }
+        else
+        {
+            // ~ and # are only special at the start of a word
+            if (!inword && (c == '~' || c == '#'))
+                return false;
+            word += c;
+            inword = true;
+        }
+    }
+    if (inword)
+        args.push_back(word);
+
+    // Leading variable assignments need the shell
+    if (args.empty() || args[0].find('=') != std::string::npos)
+        return false;
+
+    for (int i = 0; s_builtins[i]; i++)
+    {
+        if (args[0] == s_builtins[i])
+            return false;
+    }
+
+    return true;
+}
+
+// Start a command with its input from /dev/null and its output (stdout and
+// stderr) going to a pipe, which is returned in fd. As for foreground
+// commands, simple commands are executed directly and others by the shell.
+// The command starts with no signals blocked, in a new process group if
+// newgroup is set. Returns the pid, or -1 if it couldn't be started.
+static pid_t spawn_captured(const std::string &command, bool newgroup, int &fd)
+{
+    std::vector<std::string> args;
+    if (!split_command(command, args))
+    {
+        args.clear();
+        args.push_back(s_shell ? s_shell : "/bin/bash");
+        args.push_back("-c");
+        args.push_back(command);
+    }
+
+    std::vector<char *> argv;
+    for (auto it = args.begin(); it != args.end(); ++it)
+        argv.push_back(&(*it)[0]);
+    argv.push_back(0);
+
+    // The pipe is close-on-exec, so that commands started at the same time
+    // from other threads don't hold it open
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], 2);
+
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+            (newgroup ? POSIX_SPAWN_SETPGROUP : 0));
+
+    pid_t pid;
+    const int err = posix_spawnp(&pid, argv[0], &actions, &attr,
+            &argv[0], environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+
+    if (err)
+    {
+        close(pipefd[0]);
+        return -1;
+    }
+
+    fd = pipefd[0];
+    return pid;
+}
+
+// Commands run in the background, detached from the terminal in their own
+// process groups. The output of each job (stdout and stderr) is kept in a
+// ring buffer of its last OUTPUTSIZE bytes by a thread per job, which also
+// reaps the process once the output ends. The main loop is woken when jobs
+// produce output or finish.
+class JOBS {
+public:
+    static const int OUTPUTSIZE = 64*1024;
+
+    struct INFO {
+        int id;
+        std::string command;
+        pid_t pid;
+        bool done;
+        int status;
+    };
+
+    JOBS() : mynextid(1), mychanged(false) {}
+
+    // Start a job and return its id, or 0 if it couldn't be started. The
+    // job gets its own process group, so that it doesn't receive the SIGINT
+    // from the terminal and can be killed as a whole.
+    int start(const std::string &command)
+    {
+        int fd;
+        const pid_t pid = spawn_captured(command, true, fd);
+        if (pid < 0)
+            return 0;
+
+        std::lock_guard<std::mutex> lock(mylock);
+        myjobs.push_back(std::unique_ptr<JOB>(new JOB));
+        JOB &job = *myjobs.back();
+        job.id = mynextid++;
+        job.command = command;
+        job.pid = pid;
+        job.done = false;
+        job.status = 0;
+        job.output.resize(OUTPUTSIZE);
+        job.total = 0;
+        job.thread = std::thread(&JOBS::run, this, &job, fd);
+        return job.id;
+    }
+
+    // Return whether any job produced output or finished since the last call
+    bool changed() { return mychanged.exchange(false); }
+
+    void list(std::vector<INFO> &jobs) const
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        jobs.clear();
+        for (auto it = myjobs.begin(); it != myjobs.end(); ++it)
+        {
+            INFO info = { (*it)->id, (*it)->command, (*it)->pid,
+                (*it)->done, (*it)->status };
+            jobs.push_back(info);
+        }
+    }
+
+    // Count the running jobs, and those that finished with an error
+    void counts(int &running, int &failed) const
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        running = failed = 0;
+        for (auto it = myjobs.begin(); it != myjobs.end(); ++it)
+        {
+            if (!(*it)->done)
+                running++;
+            else if ((*it)->status)
+                failed++;
+        }
+    }
+
+    // Take the jobs that finished since the last call
+    void finished(std::vector<INFO> &jobs)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        jobs.clear();
+        for (auto it = myjobs.begin(); it != myjobs.end(); ++it)
+        {
+            if ((*it)->done && !(*it)->reported)
+            {
+                (*it)->reported = true;
+                INFO info = { (*it)->id, (*it)->command, (*it)->pid,
+                    true, (*it)->status };
+                jobs.push_back(info);
+            }
+        }
+    }
+
+    // The last OUTPUTSIZE bytes of output from a job
+    std::string output(int id) const
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        const JOB *job = find(id);
+        if (!job)
+            return std::string();
+
+        const uint64_t size = SYSmin(job->total, (uint64_t)OUTPUTSIZE);
+        std::string str;
+        str.reserve(size);
+        for (uint64_t i = job->total - size; i < job->total; i++)
+            str += job->output[i % OUTPUTSIZE];
+        return str;
+    }
+
+    bool kill(int id, int sig = SIGTERM)
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        const JOB *job = find(id);
+        return job && !job->done && !::kill(-job->pid, sig);
+    }
+
+    // Send SIGHUP to the running jobs, as a shell does when it exits. Their
+    // output would otherwise end up in a closed pipe.
+    void hangup()
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        for (auto it = myjobs.begin(); it != myjobs.end(); ++it)
+        {
+            if (!(*it)->done)
+                ::kill(-(*it)->pid, SIGHUP);
+        }
+    }
+
+    // Forget the finished jobs
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        for (auto it = myjobs.begin(); it != myjobs.end(); )
+        {
+            if ((*it)->done)
+            {
+                (*it)->thread.join();
+                it = myjobs.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+private:
+    struct JOB {
+        JOB() : reported(false) {}
+
+        int id;
+        std::string command;
+        pid_t pid;
+        bool done;
+        bool reported;
+        int status;
+        std::vector<char> output;
+        uint64_t total;
+        std::thread thread;
+    };
+
+    const JOB *find(int id) const
+    {
+        for (auto it = myjobs.begin(); it != myjobs.end(); ++it)
+        {
+            if ((*it)->id == id)
+                return it->get();
+        }
+        return 0;
+    }
+
+    void notify()
+    {
+        if (!mychanged.exchange(true))
+            theevents.wake();
+    }
+
+    void run(JOB *job, int fd)
+    {
+        char buf[4096];
+        ssize_t bytes;
+        while ((bytes = read(fd, buf, sizeof(buf))) != 0)
+        {
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(mylock);
+            for (ssize_t i = 0; i < bytes; i++)
+                job->output[job->total++ % OUTPUTSIZE] = buf[i];
+            notify();
+        }
+        close(fd);
+
+        int status = 0;
+        while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR)
+            ;
+
+        std::lock_guard<std::mutex> lock(mylock);
+        job->status = status;
+        job->done = true;
+        notify();
+    }
+
+    std::vector<std::unique_ptr<JOB>> myjobs;
+    int mynextid;
+    mutable std::mutex mylock;
+    std::atomic<bool> mychanged;
+};
+
+// Jobs that are still running may outlive this process, and their threads
+// use the JOB and the lock until the job exits. So thejobs is never
+// destroyed, and the threads are never joined.
+static JOBS &thejobs = *new JOBS;
+
+// Run a list of commands with up to a given number at once, like xargs -P.
+// The output of each command is collected and passed back whole once it
+// finishes, so that the output of parallel commands isn't interleaved.
+class BATCH {
+public:
+    struct RESULT {
+        int index;
+        int status;
+        std::string output;
+    };
+
+    BATCH(const std::vector<std::string> &commands, int nthreads)
+        : mycommands(commands)
+        , mynext(0)
+        , mycancel(false)
+    {
+        nthreads = SYSmax(SYSmin(nthreads, commands.size()), 1);
+        myrunning = nthreads;
+        for (int i = 0; i < nthreads; i++)
+            mythreads.push_back(std::thread(&BATCH::run, this));
+    }
+    ~BATCH()
+    {
+        cancel();
+        for (auto it = mythreads.begin(); it != mythreads.end(); ++it)
+            it->join();
+    }
+
+    // Stop starting commands. Those already running are left to finish.
+    void cancel() { mycancel = true; }
+    bool cancelled() const { return mycancel; }
+
+    bool done() const { return !myrunning; }
+
+    // Wait up to ms milliseconds for more results, and move them into
+    // results
+    void take(std::vector<RESULT> &results, int ms)
+    {
+        std::unique_lock<std::mutex> lock(mylock);
+        if (myresults.empty() && myrunning)
+            mycond.wait_for(lock, std::chrono::milliseconds(ms));
+        results.swap(myresults);
+        myresults.clear();
+    }
+
+private:
+    void run()
+    {
+        int index;
+        while (!mycancel && (index = mynext++) < (int)mycommands.size())
+        {
+            TRACE_SCOPE trace("batch.command");
+            RESULT result;
+            result.index = index;
+            result.status = W_EXITCODE(127, 0);
+
+            int fd;
+            const pid_t pid = spawn_captured(mycommands[index], false, fd);
+            if (pid >= 0)
+            {
+                char buf[4096];
+                ssize_t bytes;
+                while ((bytes = read(fd, buf, sizeof(buf))) != 0)
+                {
+                    if (bytes > 0)
+                        result.output.append(buf, bytes);
+                    else if (errno != EINTR)
+                        break;
+                }
+                close(fd);
+
+                while (waitpid(pid, &result.status, 0) < 0 && errno == EINTR)
+                    ;
+
+                // Stop at an interrupt from the terminal, as xargs does
+                if (WIFSIGNALED(result.status) &&
+                    WTERMSIG(result.status) == SIGINT)
+                    mycancel = true;
+            }
+            else
+                result.output = mycommands[index] + ": could not start\n";
+
+            std::lock_guard<std::mutex> lock(mylock);
+            myresults.push_back(result);
+            mycond.notify_one();
+        }
+
+        std::lock_guard<std::mutex> lock(mylock);
+        myrunning--;
+        mycond.notify_one();
+    }
+
+    const std::vector<std::string> &mycommands;
+    std::vector<std::thread> mythreads;
+    std::vector<RESULT> myresults;
+    std::mutex mylock;
+    std::condition_variable mycond;
+    std::atomic<int> mynext;
+    std::atomic<bool> mycancel;
+    std::atomic<int> myrunning;
+};
+
+// rename(2), but failing with EEXIST rather than replacing dst. Where the
+// filesystem doesn't support RENAME_NOREPLACE, files are moved with link(2)
+// and unlink(2), and other entries are checked for before the rename.
+static int rename_noreplace(const char *src, const char *dst)
+{
+    if (!renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE))
+        return 0;
+    if (errno != EINVAL)
+        return -1;
+
+    if (!link(src, dst))
+        return unlink(src);
+    if (errno == EEXIST)
+        return -1;
+
+    struct stat st;
+    if (!lstat(dst, &st))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(src, dst);
+}
+
+// Copy, move or delete files on a pool of worker threads. Each file and
+// directory is a task: a directory task queues a task for each of its
+// entries, and finishes (eg. is removed, for a delete) once they all have.
+// Files are copied with a reflink (FICLONE) where the filesystem supports
+// it, or else with copy_file_range() so that the data stays in the kernel.
+// The files in a large directory are deleted in chunks by several workers.
+class FILEOP {
+public:
+    enum TYPE {
+        COPY,
+        MOVE,
+        DELETE
+    };
+
+    // Each source is copied or moved to the corresponding destination
+    FILEOP(TYPE type, const std::vector<std::string> &sources,
+           const std::vector<std::string> &dests)
+        : mytype(type)
+        , mycancel(false)
+        , myactive(0)
+        , myfiles(0)
+        , mybytes(0)
+        , myerrors(0)
+        , mylastwake(0)
+    {
+        for (int i = 0; i < (int)sources.size(); i++)
+        {
+            NODE *node = new NODE(type, sources[i],
+                    i < (int)dests.size() ? dests[i] : std::string(), 0);
+            node->top = true;
+            myqueue.push_back(node);
+        }
+
+        const int nthreads = SYSmax(std::thread::hardware_concurrency(), 4);
+        myrunning = nthreads;
+        for (int i = 0; i < nthreads; i++)
+            mythreads.push_back(std::thread(&FILEOP::run, this));
+    }
+    ~FILEOP()
+    {
+        cancel();
+        wait();
+    }
+
+    void wait()
+    {
+        for (auto it = mythreads.begin(); it != mythreads.end(); ++it)
+            it->join();
+        mythreads.clear();
+    }
+
+    // Stop at the next file. A partly copied file is removed.
+    void cancel() { mycancel = true; }
+
+    TYPE type() const { return mytype; }
+    bool done() const { return !myrunning; }
+    bool cancelled() const { return mycancel; }
+    int files() const { return myfiles; }
+    uint64_t bytes() const { return mybytes; }
+    int errors() const { return myerrors; }
+
+    // The first error
+    std::string error() const
+    {
+        std::lock_guard<std::mutex> lock(mylock);
+        return myerror;
+    }
+
+private:
+    // Delete the files of a directory in chunks of this many names
+    static const int DELETECHUNK = 1024;
+
+    // Copy files in pieces of this size, to check for cancellation
+    static const int COPYCHUNK = 8*1024*1024;
+
+    struct NODE {
+        NODE(TYPE type, const std::string &src, const std::string &dst,
+             NODE *parent)
+            : type(type)
+            , src(src)
+            , dst(dst)
+            , parent(parent)
+            , pending(1)
+            , mode(0)
+            , isdir(false)
+            , top(false)
+        {}
+
+        TYPE type;
+        std::string src;
+        std::string dst;
+        NODE *parent;
+
+        // The entries not yet finished, plus one until this node has been
+        // processed
+        std::atomic<int> pending;
+        mode_t mode;
+        bool isdir;
+        bool top;
+
+        // Names of files in src to delete, for a chunk of a directory
+        std::vector<std::string> names;
+    };
+
+    void push(NODE *node)
+    {
+        node->parent->pending++;
+
+        std::lock_guard<std::mutex> lock(mylock);
+        myqueue.push_back(node);
+        mycond.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mylock);
+        while (true)
+        {
+            while (myqueue.empty() && myactive)
+                mycond.wait(lock);
+            if (myqueue.empty())
+                break;
+
+            // Take the most recent task, to walk the tree depth first and
+            // keep the queue short
+            NODE *node = myqueue.back();
+            myqueue.pop_back();
+            myactive++;
+            lock.unlock();
+
+            if (!mycancel)
+                process(node);
+            release(node);
+
+            lock.lock();
+            myactive--;
+            if (myqueue.empty() && !myactive)
+                mycond.notify_all();
+        }
+        lock.unlock();
+
+        if (--myrunning == 0)
+            theevents.wake();
+    }
+
+    void fail(const std::string &path, int err)
+    {
+        myerrors++;
+
+        std::lock_guard<std::mutex> lock(mylock);
+        if (myerror.empty())
+            myerror = path + ": " + strerror(err);
+    }
+
+    // Wake the main loop to show the progress, at most 10 times a second
+    void progress()
+    {
+        const uint64_t now = TRACE::now();
+        uint64_t last = mylastwake;
+        if (now - last > 100000000ull &&
+            mylastwake.compare_exchange_strong(last, now))
+            theevents.wake();
+    }
+
+    void process(NODE *node)
+    {
+        if (!node->names.empty())
+        {
+            delete_names(node);
+            return;
+        }
+
+        struct stat st;
+        if (lstat(node->src.c_str(), &st))
+        {
+            fail(node->src, errno);
+            return;
+        }
+
+        if (node->type == MOVE)
+        {
+            if (!rename_noreplace(node->src.c_str(), node->dst.c_str()))
+            {
+                myfiles++;
+                progress();
+                return;
+            }
+            if (errno != EXDEV)
+            {
+                fail(errno == EEXIST ? node->dst : node->src, errno);
+                return;
+            }
+
+            // Across filesystems, copy and then delete the source once the
+            // copy is complete. Nothing is copied over an existing entry.
+            struct stat dst;
+            if (!lstat(node->dst.c_str(), &dst))
+            {
+                fail(node->dst, EEXIST);
+                return;
+            }
+            node->type = COPY;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            node->isdir = true;
+            node->mode = st.st_mode & 07777;
+            if (node->type == COPY)
+                copy_dir(node);
+            else
+                delete_dir(node);
+            return;
+        }
+
+        if (node->type == COPY)
+            copy_file(node, st);
+        else if (unlink(node->src.c_str()))
+            fail(node->src, errno);
+        else
+        {
+            myfiles++;
+            progress();
+        }
+    }
+
+    void copy_dir(NODE *node)
+    {
+        // Don't copy a directory into itself
+        if (!node->dst.compare(0, node->src.length() + 1, node->src + "/"))
+        {
+            fail(node->src, EINVAL);
+            return;
+        }
+
+        // The copy is writable until its entries are in place
+        if (mkdir(node->dst.c_str(), node->mode | S_IRWXU))
+        {
+            fail(node->dst, errno);
+            return;
+        }
+
+        DIR *dp = opendir(node->src.c_str());
+        if (!dp)
+        {
+            fail(node->src, errno);
+            return;
+        }
+
+        const struct dirent *result;
+        while (!mycancel && (result = readdir(dp)))
+        {
+            if (!strcmp(result->d_name, ".") || !strcmp(result->d_name, ".."))
+                continue;
+            push(new NODE(COPY, node->src + "/" + result->d_name,
+                        node->dst + "/" + result->d_name, node));
+        }
+        closedir(dp);
+    }
+
+    void copy_file(NODE *node, const struct stat &st)
+    {
+        const char *src = node->src.c_str();
+        const char *dst = node->dst.c_str();
+
+        if (S_ISLNK(st.st_mode))
+        {
+            char target[FILENAME_MAX];
+            ssize_t len = readlink(src, target, sizeof(target)-1);
+            if (len < 0)
+                fail(node->src, errno);
+            else
+            {
+                target[len] = '\0';
+                if (symlink(target, dst))
+                    fail(node->dst, errno);
+                else
+                    myfiles++;
+            }
+            return;
+        }
+
+        if (!S_ISREG(st.st_mode))
+        {
+            fail(node->src, ENOTSUP);
+            return;
+        }
+
+        int in = open(src, O_RDONLY | O_CLOEXEC);
+        if (in < 0)
+        {
+            fail(node->src, errno);
+            return;
+        }
+
+        int out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                st.st_mode & 07777);
+        if (out < 0)
+        {
+            fail(node->dst, errno);
+            close(in);
+            return;
+        }
+
+        int err = 0;
+        if (ioctl(out, FICLONE, in))
+        {
+            // Without reflinks, copy in the kernel, and fall back to a
+            // plain copy where that isn't supported
+            off_t copied = 0;
+            bool kernel = true;
+            while (copied < st.st_size && !mycancel)
+            {
+                ssize_t bytes = -1;
+                if (kernel)
+                {
+                    bytes = copy_file_range(in, 0, out, 0, COPYCHUNK, 0);
+                    if (bytes < 0 && copied == 0 &&
+                        (errno == EXDEV || errno == ENOSYS ||
+                         errno == EINVAL || errno == EOPNOTSUPP))
+                    {
+                        kernel = false;
+                        continue;
+                    }
+                }
+                else
+                    bytes = copy_chunk(in, out);
+
+                if (bytes < 0)
+                {
+                    err = errno;
+                    break;
+                }
+                if (bytes == 0)
+                    break;
+
+                copied += bytes;
+                mybytes += bytes;
+                progress();
+            }
+        }
+        else
+            mybytes += st.st_size;
+
+        close(in);
+        if (close(out) && !err)
+            err = errno;
+
+        if (err || mycancel)
+        {
+            unlink(dst);
+            if (err)
+                fail(node->dst, err);
+            return;
+        }
+
+        myfiles++;
+        progress();
+    }
+
+    static ssize_t copy_chunk(int in, int out)
+    {
+        char buf[64*1024];
+        ssize_t bytes = read(in, buf, sizeof(buf));
+        for (ssize_t done = 0; bytes > 0 && done < bytes; )
+        {
+            ssize_t written = write(out, buf + done, bytes - done);
+            if (written < 0)
+                return -1;
+            done += written;
+        }
+        return bytes;
+    }
+
+    void delete_dir(NODE *node)
+    {
+        DIR *dp = opendir(node->src.c_str());
+        if (!dp)
+        {
+            fail(node->src, errno);
+            return;
+        }
+
+        NODE *chunk = 0;
+        const struct dirent *result;
+        while (!mycancel && (result = readdir(dp)))
+        {
+            if (!strcmp(result->d_name, ".") || !strcmp(result->d_name, ".."))
+                continue;
+
+            if (result->d_type == DT_DIR || result->d_type == DT_UNKNOWN)
+            {
+                push(new NODE(DELETE, node->src + "/" + result->d_name,
+                            std::string(), node));
+                continue;
+            }
+
+            if (!chunk)
+                chunk = new NODE(DELETE, node->src, std::string(), node);
+            chunk->names.push_back(result->d_name);
+            if (chunk->names.size() == DELETECHUNK)
+            {
+                push(chunk);
+                chunk = 0;
+            }
+        }
+        if (chunk)
+            push(chunk);
+        closedir(dp);
+    }
+
+    void delete_names(NODE *node)
+    {
+        int fd = open(node->src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fail(node->src, errno);
+            return;
+        }
+
+        for (auto it = node->names.begin(); it != node->names.end(); ++it)
+        {
+            if (mycancel)
+                break;
+            if (unlinkat(fd, it->c_str(), 0))
+                fail(node->src + "/" + *it, errno);
+            else
+                myfiles++;
+        }
+        close(fd);
+        progress();
+    }
+
+    // Finish the nodes that have no more entries in progress, from node up
+    // towards the root
+    void release(NODE *node)
+    {
+        while (node && --node->pending == 0)
+        {
+            if (node->isdir && !mycancel)
+                finish_dir(node);
+
+            // A move across filesystems deletes the source once it's
+            // copied
+            if (node->top && mytype == MOVE && node->type == COPY &&
+                !mycancel && !myerrors)
+            {
+                NODE *remove = new NODE(DELETE, node->src, std::string(), 0);
+                remove->top = true;
+
+                std::lock_guard<std::mutex> lock(mylock);
+                myqueue.push_back(remove);
+                mycond.notify_one();
+            }
+
+            NODE *parent = node->parent;
+            delete node;
+            node = parent;
+        }
+    }
+
+    void finish_dir(NODE *node)
+    {
+        if (node->type == COPY)
+        {
+            if ((node->mode & S_IRWXU) != S_IRWXU)
+                chmod(node->dst.c_str(), node->mode);
+            myfiles++;
+        }
+        else if (rmdir(node->src.c_str()))
+            fail(node->src, errno);
+        else
+            myfiles++;
+        progress();
+    }
+
+    TYPE mytype;
+    std::vector<std::thread> mythreads;
+    std::vector<NODE *> myqueue;
+    mutable std::mutex mylock;
+    std::condition_variable mycond;
+    std::atomic<bool> mycancel;
+    int myactive;
+    std::atomic<int> myrunning;
+    std::atomic<int> myfiles;
+    std::atomic<uint64_t> mybytes;
+    std::atomic<int> myerrors;
+    std::atomic<uint64_t> mylastwake;
+    std::string myerror;
+};
+
+static std::unique_ptr<FILEOP> thefileop;
+
+// Reading a page of a mapped file beyond the end of the file, which happens
+// if the file is truncated while it's mapped, raises SIGBUS. The handler
+// jumps back to the innermost sigbus_guard() of the thread.
+static thread_local sigjmp_buf *volatile s_sigbusjmp = 0;
+
+static void sigbus_handler(int sig)
+{
+    if (s_sigbusjmp)
+        siglongjmp(*s_sigbusjmp, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Run fn, which reads a mapped file. Returns false if the file was
+// truncated under it, cutting fn short. Since the jump skips the rest of
+// fn, it must only copy or search bytes into plain variables: nothing in it
+// may need a destructor, allocate or draw.
+template <typename FN>
+static bool sigbus_guard(const FN &fn)
+{
+    static bool installed = false;
+    if (!installed)
+    {
+        // SIGBUS isn't blocked in the handler, so the mask needn't be saved
+        // and restored by each guard
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sigbus_handler;
+        sa.sa_flags = SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, 0);
+        installed = true;
+    }
+
+    sigjmp_buf jmp;
+    sigjmp_buf *prev = s_sigbusjmp;
+    if (sigsetjmp(jmp, 0))
+    {
+        s_sigbusjmp = prev;
+        return false;
+    }
+    // The fences keep the reads in fn between setting and resetting the
+    // jump, where fn is inlined
+    s_sigbusjmp = &jmp;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    fn();
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    s_sigbusjmp = prev;
+    return true;
+}
+
+// A read-only view of a file through mmap(2), so that files of any size
+// open instantly and only the pages shown or searched are read. Positions
+// are byte offsets of the start of a line. Line numbers come from an index
+// with the offset of every STRIDE'th line, which is built on demand as far
+// as a jump or the view needs, so a huge file is never scanned up front.
+// Lines longer than MAXLINE are shown in pieces.
+class FILEVIEW {
+public:
+    static const int STRIDE = 256;
+    static const uint64_t MAXLINE = 1 << 20;
+
+    FILEVIEW()
+        : mytop(0)
+        , mycol(0)
+        , myfollow(false)
+        , myfd(-1)
+        , mydata(0)
+        , mysize(0)
+        , mymapped(0)
+        , mytruncated(false)
+        , myindexed(0)
+        , mylines(0)
+    {
+        mycheckpoints.push_back(0);
+    }
+    ~FILEVIEW()
+    {
+        if (mymapped)
+            munmap((void *)mydata, mymapped);
+        if (myfd >= 0)
+            close(myfd);
+    }
+
+    bool open(const std::string &path)
+    {
+        mypath = path;
+        myfd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (myfd < 0)
+        {
+            myerror = strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(myfd, &st) || !S_ISREG(st.st_mode))
+        {
+            myerror = "Not a regular file";
+            return false;
+        }
+        return remap(st.st_size);
+    }
+
+    // Pick up a change in the size of the file. Returns true if it changed.
+    bool reload()
+    {
+        mytruncated = false;
+
+        struct stat st;
+        if (fstat(myfd, &st) || (uint64_t)st.st_size == mysize)
+            return false;
+
+        if ((uint64_t)st.st_size < myindexed)
+        {
+            // Truncated (eg. a log that was rotated in place)
+            mycheckpoints.assign(1, 0);
+            myindexed = 0;
+            mylines = 0;
+        }
+        remap(st.st_size);
+        mytop = std::min(mytop, last_page(1));
+        return true;
+    }
+
+    const std::string &path() const { return mypath; }
+    const std::string &error() const { return myerror; }
+    uint64_t size() const { return mysize; }
+
+    // Whether the file was found to be truncated by a read since the last
+    // reload(). Reads then act as if the file ended where they started.
+    bool truncated() const { return mytruncated; }
+
+    // The end of the line starting at off, excluding the newline
+    uint64_t line_end(uint64_t off) const
+    {
+        const uint64_t len = std::min(mysize - off, MAXLINE);
+        const char *nl = 0;
+        if (!guarded([&]() { nl = (const char *)memchr(mydata + off, '\n', len); }))
+            return off;
+        return nl ? nl - mydata : off + len;
+    }
+
+    // The start of the next line, or off itself at the last line
+    uint64_t next_line(uint64_t off) const
+    {
+        uint64_t end = line_end(off);
+        char c = 0;
+        if (end < mysize && !guarded([&]() { c = mydata[end]; }))
+            return off;
+        if (c == '\n')
+            end++;
+        return end < mysize ? end : off;
+    }
+
+    // The start of the line before the one starting at off
+    uint64_t prev_line(uint64_t off) const
+    {
+        return off ? line_start(off-1) : 0;
+    }
+
+    // The start of the line containing off
+    uint64_t line_start(uint64_t off) const
+    {
+        if (!off)
+            return 0;
+        const uint64_t len = std::min(off, MAXLINE);
+        const char *nl = 0;
+        if (!guarded([&]()
+                { nl = (const char *)memrchr(mydata + off - len, '\n', len); }))
+            return 0;
+        return nl ? nl - mydata + 1 : off - len;
+    }
+
+    // The offset of the top line when the end of the file fills a page
+    uint64_t last_page(int rows) const
+    {
+        uint64_t off = line_start(mysize ? mysize-1 : 0);
+        for (int i = 1; i < rows && off; i++)
+            off = prev_line(off);
+        return off;
+    }
+
+    // Index lines until the line (counting from 0) or the byte offset is
+    // reached. Returns false if a key interrupted the scan.
+    bool index(uint64_t line, uint64_t off)
+    {
+        const uint64_t chunk = 16 << 20;
+        off = std::min(off, mysize);
+        while (mylines < line && myindexed < off && !mytruncated)
+        {
+            if (!theheadless && getch() != ERR)
+                return false;
+            scan(std::min(myindexed + chunk, off));
+        }
+        return true;
+    }
+
+    // The offset of a line (counting from 0), or the last line if the file
+    // is shorter. Returns false if interrupted.
+    bool line_offset(uint64_t line, uint64_t &off)
+    {
+        if (!index(line, mysize))
+            return false;
+
+        const uint64_t k = std::min(line / STRIDE,
+                (uint64_t)mycheckpoints.size()-1);
+        off = mycheckpoints[k];
+        for (uint64_t i = k * STRIDE; i < line; i++)
+        {
+            const uint64_t next = next_line(off);
+            if (next == off)
+                break;
+            off = next;
+        }
+        return true;
+    }
+
+    // The number of the line starting at off, if the index reaches it
+    bool line_number(uint64_t off, uint64_t &line) const
+    {
+        if (off > myindexed)
+            return false;
+
+        const int k = std::upper_bound(mycheckpoints.begin(),
+                mycheckpoints.end(), off) - mycheckpoints.begin() - 1;
+        uint64_t n = (uint64_t)k * STRIDE;
+        const uint64_t start = mycheckpoints[k];
+        if (!guarded([&]()
+                {
+                    for (uint64_t pos = start; pos < off; n++)
+                    {
+                        const char *nl = (const char *)memchr(
+                                mydata + pos, '\n', off - pos);
+                        if (!nl)
+                            break;
+                        pos = nl - mydata + 1;
+                    }
+                }))
+            return false;
+        line = n;
+        return true;
+    }
+
+    // Find the next line after (or before) the line at off with a match.
+    // A pattern without regex syntax is found with a scan of the mapped
+    // file, and otherwise each line is tested with SPY_REGEX. Returns false
+    // if there's no match or a key interrupted the search. The search stops
+    // if the file is truncated while it runs.
+    bool find(const std::string &pattern, const SPY_REGEX &regex,
+              bool forward, uint64_t &off, bool &interrupted)
+    {
+        reload();
+        interrupted = false;
+        const bool found = find_match(pattern, regex, forward, off,
+                interrupted);
+        if (mytruncated)
+        {
+            reload();
+            mymsg = "File truncated";
+            return false;
+        }
+        return found;
+    }
+
+    // Draw the lines from the top of the view, with matches of the search
+    // highlighted, and a status line. The file is checked for a change in
+    // size first.
+    void draw(const SPY_REGEX *search)
+    {
+        reload();
+        erase();
+
+        // Status line: name, line, offset and position in the file
+        uint64_t bottom = draw_lines(search);
+        std::string where;
+        uint64_t line;
+        if (line_number(mytop, line))
+            where = "line " + std::to_string(line+1) + "  ";
+        if (mytruncated)
+        {
+            // The lines may have been cut short, so show none of them
+            reload();
+            erase();
+            bottom = mytop;
+            where.clear();
+            mymsg = "File truncated";
+        }
+
+        char buf[BUFSIZE];
+        snprintf(buf, BUFSIZE, "%s  %sbyte %llu/%llu  %d%%%s",
+                mypath.c_str(), where.c_str(), (unsigned long long)mytop,
+                (unsigned long long)mysize,
+                mysize ? (int)(100 * std::min(bottom + 1, mysize) / mysize) : 100,
+                myfollow ? "  [follow]" : "");
+        std::string status = mymsg.empty() ? buf : mymsg;
+
+        attrset(A_REVERSE);
+        mvaddnstr(LINES-1, 0, status.c_str(), COLS-1);
+        attrset(A_NORMAL);
+    }
+
+    // The view: the offset of the top line, the first column shown, whether
+    // to stay at the end as the file grows, and a message for the status line
+    uint64_t mytop;
+    uint64_t mycol;
+    bool myfollow;
+    std::string mymsg;
+
+private:
+    bool find_match(const std::string &pattern, const SPY_REGEX &regex,
+                    bool forward, uint64_t &off, bool &interrupted) const
+    {
+        if (pattern.empty())
+            return false;
+
+        if (forward && is_literal(pattern))
+        {
+            const uint64_t chunk = 64 << 20;
+            uint64_t start = next_line(off);
+            if (start == off)
+                return false;
+            while (start < mysize)
+            {
+                if (!theheadless && getch() != ERR)
+                {
+                    interrupted = true;
+                    return false;
+                }
+
+                // Overlap the chunks so that a match can span them
+                const uint64_t end = std::min(start + chunk, mysize);
+                const char *match = 0;
+                if (!guarded([&]()
+                        { match = find_literal(mydata + start, mydata + end,
+                            pattern); }))
+                    return false;
+                if (match)
+                {
+                    off = line_start(match - mydata);
+                    return true;
+                }
+                if (end == mysize)
+                    break;
+                start = end - SYSmin(pattern.length()-1, end - start);
+            }
+            return false;
+        }
+
+        std::string line;
+        uint64_t pos = off;
+        for (uint64_t n = 1;; n++)
+        {
+            const uint64_t next = forward ? next_line(pos) : prev_line(pos);
+            if (next == pos || mytruncated)
+                return false;
+            pos = next;
+
+            if (!(n % 65536) && !theheadless && getch() != ERR)
+            {
+                interrupted = true;
+                return false;
+            }
+
+            // Copy the line to search it, since the regex mustn't run on the
+            // mapping unguarded
+            line.resize(line_end(pos) - pos);
+            if (!line.empty() && !guarded([&]()
+                    { memcpy(&line[0], mydata + pos, line.size()); }))
+                return false;
+            int start, end;
+            if (regex.search(line.c_str(), start, end))
+            {
+                off = pos;
+                return true;
+            }
+        }
+    }
+
+    // Draw the lines from the top of the view, with matches of the search
+    // highlighted. Returns the end of the last line drawn.
+    uint64_t draw_lines(const SPY_REGEX *search) const
+    {
+        const int rows = LINES-1;
+        static std::vector<chtype> row;
+        static std::vector<char> bytes;
+        std::string text;
+        uint64_t off = mytop;
+        uint64_t bottom = mytop;
+        for (int y = 0; y < rows && off < mysize; y++)
+        {
+            const uint64_t end = line_end(off);
+            bottom = end;
+
+            // Copy as much of the line as can reach the right edge of the
+            // screen, since each byte takes at least one column
+            const uint64_t maxcol = mycol + COLS;
+            bytes.resize(std::min(end - off, maxcol));
+            if (mytruncated || (!bytes.empty() && !guarded([&]()
+                    { memcpy(&bytes[0], mydata + off, bytes.size()); })))
+                break;
+
+            // Expand tabs up to the right edge of the screen
+            text.clear();
+            for (uint64_t i = 0; i < bytes.size() && text.length() < maxcol; i++)
+            {
+                const unsigned char c = bytes[i];
+                if (c == '\t')
+                    text.append(8 - text.length() % 8, ' ');
+                else if (c < ' ' || c == 0x7f)
+                    text += c == '\r' && off+i+1 == end ? ' ' : '.';
+                else
+                    text += c;
+            }
+
+            row.clear();
+            for (uint64_t i = mycol; i < text.length() && i < maxcol; i++)
+                row.push_back((unsigned char)text[i]);
+
+            // Highlight each match on the line
+            int start, mend;
+            for (int pos = 0; search && pos < (int)text.length() &&
+                    search->search(text.c_str() + pos, start, mend); )
+            {
+                for (int i = pos + start; i < pos + mend; i++)
+                {
+                    if (i >= (int)mycol && i - mycol < row.size())
+                        row[i - mycol] = (row[i - mycol] & A_CHARTEXT) |
+                            COLOR_PAIR(8) | A_REVERSE;
+                }
+                pos += SYSmax(mend, start+1);
+            }
+
+            if (!row.empty())
+                mvaddchnstr(y, 0, &row[0], row.size());
+
+            const uint64_t next = next_line(off);
+            if (next == off)
+                break;
+            off = next;
+        }
+        return bottom;
+    }
+
+    bool remap(uint64_t size)
+    {
+        if (size && mymapped)
+        {
+            void *data = mremap((void *)mydata, mymapped, size, MREMAP_MAYMOVE);
+            if (data == MAP_FAILED)
+            {
+                myerror = strerror(errno);
+                return false;
+            }
+            mydata = (const char *)data;
+            mymapped = size;
+        }
+        else if (size)
+        {
+            void *data = mmap(0, size, PROT_READ, MAP_SHARED, myfd, 0);
+            if (data == MAP_FAILED)
+            {
+                myerror = strerror(errno);
+                return false;
+            }
+            mydata = (const char *)data;
+            mymapped = size;
+        }
+        mysize = size;
+        return true;
+    }
+
+    // Run fn, which reads the mapped file, under sigbus_guard(). If the file
+    // has been truncated, mytruncated is set until the next reload().
+    template <typename FN>
+    bool guarded(const FN &fn) const
+    {
+        if (sigbus_guard(fn))
+            return true;
+        mytruncated = true;
+        return false;
+    }
+
+    // Count the newlines from myindexed up to end, recording a checkpoint
+    // at the start of every STRIDE'th line. The checkpoints of each block
+    // are collected in an array first, since the guarded scan mustn't
+    // allocate.
+    void scan(uint64_t end)
+    {
+        TRACE_SCOPE trace("viewer.index");
+        const uint64_t block = 1 << 20;
+        uint64_t marks[block / STRIDE + 1];
+        while (myindexed < end)
+        {
+            const uint64_t stop = std::min(myindexed + block, end);
+            uint64_t lines = mylines;
+            int n = 0;
+            if (!guarded([&]()
+                    { n = count_lines(myindexed, stop, lines, marks); }))
+                return;
+
+            mycheckpoints.insert(mycheckpoints.end(), marks, marks + n);
+            mylines = lines;
+            myindexed = stop;
+        }
+    }
+
+    // Count the newlines from start up to end into lines, and store the
+    // start of every STRIDE'th line in marks. Returns the number stored.
+    // The scan compares 16 bytes at a time where SSE2 is available.
+    int count_lines(uint64_t start, uint64_t end, uint64_t &lines,
+                    uint64_t *marks) const
+    {
+        int n = 0;
+        const char *p = mydata + start;
+        const char *stop = mydata + end;
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (; p + 16 <= stop; p += 16)
+        {
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)p), newline));
+            while (mask)
+            {
+                const int bit = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (!(++lines % STRIDE))
+                    marks[n++] = p + bit + 1 - mydata;
+            }
+        }
+#endif
+        for (; p < stop; p++)
+        {
+            if (*p == '\n' && !(++lines % STRIDE))
+                marks[n++] = p + 1 - mydata;
+        }
+        return n;
+    }
+
+    static bool is_literal(const std::string &pattern)
+    {
+        return pattern.find_first_of(".[]()*+?{}|^$\\") == std::string::npos;
+    }
+
+    // memmem(3), but ignoring case like SPY_REGEX with RELAXCASE. The scan
+    // is for either case of the first character with memchr(3), keeping
+    // the next of each so that neither is scanned for twice.
+    static const char *find_literal(const char *start, const char *end,
+                                    const std::string &pattern)
+    {
+        const size_t n = pattern.length();
+        if (!RELAXCASE)
+            return (const char *)memmem(start, end - start, pattern.c_str(), n);
+
+        const char lc = tolower(pattern[0]);
+        const char uc = toupper(pattern[0]);
+        auto next = [end](char c, const char *from)
+        {
+            const char *p = (const char *)memchr(from, c, end - from);
+            return p ? p : end;
+        };
+
+        const char *nextlc = next(lc, start);
+        const char *nextuc = lc == uc ? end : next(uc, start);
+        while (true)
+        {
+            const char *p = std::min(nextlc, nextuc);
+            if (end - p < (ptrdiff_t)n)
+                return 0;
+            if (!strncasecmp(p, pattern.c_str(), n))
+                return p;
+            if (p == nextlc)
+                nextlc = next(lc, p+1);
+            else
+                nextuc = next(uc, p+1);
+        }
+    }
+
+    std::string mypath;
+    std::string myerror;
+    int myfd;
+    const char *mydata;
+    uint64_t mysize;
+    uint64_t mymapped;
+    mutable bool mytruncated;
+
+    // Line index
+    std::vector<uint64_t> mycheckpoints;
+    uint64_t myindexed;
+    uint64_t mylines;
+};
+
+// The file open in the viewer, which readline prompts draw behind them
+static FILEVIEW *theviewer = 0;
+
+// Directory listings for filename completion, by absolute path. The names
+// are sorted on first use, so that completing a prefix is a binary search,
+// and directories have a trailing '/'. Directories that spy has listed are
+// added from thefiles, so only other directories need to be read. A listing
+// is read again once it is older than its filesystem profile's TTL, since
+// changes on a network filesystem may not be reported by inotify.
+class LISTINGCACHE {
+public:
+    LISTINGCACHE() : myclock(0) {}
+
+    bool has(const std::string &dir) const
+    {
+        auto it = mylistings.find(dir);
+        return it != mylistings.end() && time(0) < it->second.expires;
+    }
+    void erase(const std::string &dir) { mylistings.erase(dir); }
+
+    // Add a listing that stays cached for ttl seconds, taking the contents
+    // of names
+    void set(const std::string &dir, std::vector<std::string> &names,
+             int ttl)
+    {
+        if (mylistings.size() >= MAXLISTINGS && !has(dir))
+        {
+            auto oldest = mylistings.begin();
+            for (auto it = mylistings.begin(); it != mylistings.end(); ++it)
+            {
+                if (it->second.lastuse < oldest->second.lastuse)
+                    oldest = it;
+            }
+            mylistings.erase(oldest);
+        }
+
+        LISTING &listing = mylistings[dir];
+        listing.names.swap(names);
+        listing.sorted = false;
+        listing.lastuse = ++myclock;
+        listing.expires = time(0) + ttl;
+    }
+
+    // Get the sorted listing for dir, reading it if it isn't cached
+    const std::vector<std::string> &get(const std::string &dir)
+    {
+        if (!has(dir))
+        {
+            std::vector<std::string> names;
+            const int ttl = read(dir, names);
+            set(dir, names, ttl);
+        }
+
+        LISTING &listing = mylistings[dir];
+        if (!listing.sorted)
+        {
+            std::sort(listing.names.begin(), listing.names.end());
+            listing.sorted = true;
+        }
+        listing.lastuse = ++myclock;
+        return listing.names;
+    }
+
+private:
+    static const int MAXLISTINGS = 16;
+
+    struct LISTING {
+        std::vector<std::string> names;
+        bool sorted;
+        int lastuse;
+        time_t expires;
+    };
+
+    // Read the directory under thefsguard, so that completing in a
+    // directory on an unresponsive filesystem doesn't hang. Returns the
+    // seconds to cache it for.
+    static int read(const std::string &dir, std::vector<std::string> &names)
+    {
+        struct RESULT {
+            std::vector<std::string> names;
+            long fstype;
+        };
+        std::shared_ptr<RESULT> result(new RESULT);
+        result->fstype = 0;
+        if (!thefsguard.run(absolute_path(dir), [dir, result]()
+                    { result->fstype = readnames(dir, result->names); }))
+            return 0;
+
+        names.swap(result->names);
+        return fsprofile(result->fstype).mycachettl;
+    }
+
+    // Returns the filesystem type
+    static long readnames(const std::string &dir,
+                          std::vector<std::string> &names)
+    {
+        DIR *dp = opendir(dir.c_str());
+        if (!dp)
+            return 0;
+
+        const struct dirent *result;
+        while ((result = readdir(dp)))
+        {
+            if (!strcmp(result->d_name, ".") || !strcmp(result->d_name, ".."))
+                continue;
+
+            names.push_back(result->d_name);
+
+            bool isdir = result->d_type == DT_DIR;
+            if (result->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                std::string path = dir + "/" + result->d_name;
+                isdir = !lstat(path.c_str(), &st) && S_ISDIR(st.st_mode);
+            }
+            if (isdir)
+                names.back() += '/';
+        }
+
+        const long type = fstype(dp);
+        closedir(dp);
+        return type;
+    }
+
+    std::map<std::string, LISTING> mylistings;
+    int myclock;
+};
+
+static LISTINGCACHE thelistings;
+
+// Add the current directory listing to the completion cache
+static void cache_listing()
+{
+    if (thelisting != LISTING_DIRECTORY || thelistings.has(thecwd))
+        return;
+
+    std::vector<std::string> names;
+    names.reserve(thefiles.size());
+    for (auto it = thefiles.begin(); it != thefiles.end(); ++it)
+    {
+        names.push_back(it->name());
+        if (it->isdirectory())
+            names.back() += '/';
+    }
+    thelistings.set(thecwd, names, thefsprofile->mycachettl);
+}
+
+static int itoawidth(size_t size)
+{
+    int width = 0;
+    while (size)
+    {
+        width++;
+        size /= 10;
+    }
+    return SYSmax(width, 1);
+}
+
+// Histograms of the name length and size width of the entries in the view.
+// These are updated as entries enter and leave the view, so that the layout
+// can find the widest entry without a pass over the view.
+class WIDTHS {
+public:
+    WIDTHS() : mymaxname(0), mymaxsize(0) {}
+
+    void clear()
+    {
+        mynames.clear();
+        mysizes.clear();
+        mymaxname = 0;
+        mymaxsize = 0;
+    }
+
+    void add(const DIRINFO &dir) { update(dir, 1); }
+    void remove(const DIRINFO &dir) { update(dir, -1); }
+
+    int maxname() const { return mymaxname; }
+    int maxsize() const { return mymaxsize; }
+
+private:
+    void update(const DIRINFO &dir, int count)
+    {
+        bump(mynames, mymaxname, dir.name().length(), count);
+
+        // The sizes are only needed (and only loaded) when they are shown.
+        // Changing the detail mode rebuilds the view.
+        if (thedetail == DETAIL_SIZE)
+            bump(mysizes, mymaxsize, itoawidth(dir.size()), count);
+    }
+
+    static void bump(std::vector<int> &hist, int &max, int width, int count)
+    {
+        if (width >= hist.size())
+            hist.resize(width+1, 0);
+        hist[width] += count;
+
+        if (count > 0)
+            max = SYSmax(max, width);
+        else
+        {
+            while (max > 0 && !hist[max])
+                max--;
+        }
+    }
+
+    std::vector<int> mynames;
+    std::vector<int> mysizes;
+    int mymaxname;
+    int mymaxsize;
+};
+
+static WIDTHS thewidths;
+
+// With packed columns, each column is as wide as its widest entry rather
+// than all columns being as wide as the widest entry in the view. Column k
+// (counting across pages) starts thecolx[k] - thecolx[first column of its
+// page] cells from the left.
+static bool thepackcolumns = false;
+static std::vector<int> thecolx;
+
+// Find the most columns per page for which every page fits in xsize
+static void pack_columns(int xsize, int extra)
+{
+    const int ncolumns = (nfiles() + therows - 1) / therows;
+
+    thecolx.assign(ncolumns + 1, 0);
+    int minwidth = xsize;
+    for (int k = 0; k < ncolumns; k++)
+    {
+        int width = 0;
+        const int end = SYSmin((k+1) * therows, nfiles());
+        for (int i = k * therows; i < end; i++)
+            width = SYSmax(width, getfile(i).name().length());
+        width += extra;
+        thecolx[k+1] = thecolx[k] + width;
+        minwidth = SYSmin(minwidth, width);
+    }
+
+    thecols = SYSmin(xsize / SYSmax(minwidth, 1), ncolumns);
+    for (; thecols > 1; thecols--)
+    {
+        bool fits = true;
+        for (int k = 0; fits && k < ncolumns; k += thecols)
+        {
+            const int end = SYSmin(k + thecols, ncolumns);
+            fits = thecolx[end] - thecolx[k] <= xsize;
+        }
+        if (fits)
+            break;
+    }
+    thecols = SYSmax(thecols, 1);
+}
+
+static void layout(int ysize, int xsize)
+{
+    // The cells for each entry are the detail, the name and padding
+    int extra = 2*XPADDING;
+    switch (thedetail)
+    {
+        case DETAIL_NONE:
+            extra += 2;
+            break;
+        case DETAIL_SIZE:
+            thedetailsizewidth = SYSmax(thewidths.maxsize(), 1);
+            extra += thedetailsizewidth+2;
+            break;
+        case DETAIL_TIME:
+            extra += thedetailtimewidth+2;
+            break;
+        case DETAIL_OWNER:
+        case DETAIL_GROUP:
+            extra += thedetailidwidth+2;
+            break;
+    }
+
+    therows = SYSmax(ysize, 1);
+    if (thepackcolumns)
+        pack_columns(xsize, extra);
+    else
+    {
+        thecols = xsize / (thewidths.maxname() + extra);
+        thecols = SYSmax(thecols, 1);
+    }
+
+    thepages = (nfiles()-1) / (thecols * therows) + 1;
+
+    damage();
+}
+
+static void filetopage(int file, int &page, int &col, int &row)
+{
+    page = file / (therows*thecols);
+
+    file %= (therows*thecols);
+    col = file / therows;
+    row = file % therows;
+}
+
+static void pagetofile(int &file, int page, int col, int row)
+{
+    file = row + therows*(col + thecols*page);
+}
+
+static void filetopage()
+{ filetopage(thecurfile, thecurpage, thecurcol, thecurrow); }
+static void pagetofile()
+{ pagetofile(thecurfile, thecurpage, thecurcol, thecurrow); }
+
+// Set the current file to the one matching the given name, if it exists
+static void find_and_set_curfile(const std::string &name)
+{
+    for (int file = 0; file < nfiles(); file++)
+    {
+        if (name == getfile(file).name())
+        {
+            thecurfile = file;
+            filetopage();
+            break;
+        }
+    }
+}
+
+// Filter info. The filter is a case-insensitive literal substring, so a
+// filter that contains the previous one can only narrow the previous result
+// set. In that case only the entries in the current view are re-tested.
+static std::string thefilter;
+
+// Query info. The query mask holds the result of the query for each entry in
+// thefiles, and is empty when there is no query.
+static QUERY thequery;
+static std::string thequerystr;
+static std::vector<char> thequerymask;
+
+static bool filtered(const DIRINFO &dir, const std::string &filter)
+{
+    return !filter.empty() && ci_find_substr(dir.name(), filter) < 0;
+}
+
+// Rebuild the view from scratch for the current filter and query
+static void build_view()
+{
+    theview.clear();
+    theview.reserve(thefiles.size());
+    thewidths.clear();
+    for (int i = 0; i < thefiles.size(); i++)
+    {
+        if (!thequerymask.empty() && !thequerymask[i])
+            continue;
+        if (!filtered(thefiles[i], thefilter))
+        {
+            theview.push_back(i);
+            thewidths.add(thefiles[i]);
+        }
+    }
+}
+
+static void evaluate_query()
+{
+    if (thequery.empty())
+    {
+        thequerymask.clear();
+        return;
+    }
+
+    parallel_stat(thefiles);
+    thequery.evaluate(thefiles, thequerymask);
+}
+
+// Select the entry at curindex in thefiles after the view changed, or the
+// next one after it in the view, and lay out the view
+static void finish_view(int curindex)
+{
+    // The view is sorted by index, so this is a binary search
+    thecurfile = std::lower_bound(theview.begin(), theview.end(), curindex) -
+        theview.begin();
+    if (thecurfile >= nfiles())
+        thecurfile = nfiles() ? nfiles()-1 : 0;
+
+    // Only the survivors need to be laid out
+    layout(LINES-3, COLS);
+    filetopage();
+}
+
+static void setfilter(const std::string &filter)
+{
+    if (filter == thefilter)
+        return;
+
+    // Remember which entry was current so that it can be kept if it
+    // survives the filter
+    int curindex = thecurfile < nfiles() ? theview[thecurfile] : 0;
+
+    if (!thefilter.empty() && ci_find_substr(filter, thefilter) >= 0)
+    {
+        int n = 0;
+        for (int i = 0; i < nfiles(); i++)
+        {
+            if (!filtered(getfile(i), filter))
+                theview[n++] = theview[i];
+            else
+                thewidths.remove(getfile(i));
+        }
+        theview.resize(n);
+        thefilter = filter;
+    }
+    else
+    {
+        thefilter = filter;
+        build_view();
+    }
+
+    finish_view(curindex);
+}
+
+static bool setquery(const std::string &str)
+{
+    QUERY query;
+    std::string err;
+    if (!query.compile(str, err))
+    {
+        themsg = "Invalid query: " + err;
+        return false;
+    }
+
+    int curindex = thecurfile < nfiles() ? theview[thecurfile] : 0;
+
+    thequery = query;
+    thequerystr = thequery.empty() ? "" : str;
+    evaluate_query();
+    build_view();
+
+    finish_view(curindex);
+    return true;
+}
+
+static void layout()
+{
+    layout(LINES-3, COLS);
+
+    filetopage();
+
+    // Clear the screen for the next draw. This is for user-controlled redraw,
+    // which should clear any garbage left on the screen by background jobs.
+    clear();
+}
+
+// Record a span from start until now, and start the next one
+static void trace_phase(const char *name, uint64_t &start)
+{
+    const uint64_t end = TRACE::now();
+    TRACE::instance().record(name, start, end);
+    start = end;
+}
+
+// Sort the entries in runs that are then merged, checking for a key between
+// each step so that sorting a huge directory can be abandoned. Returns false
+// if it was, leaving the entries partly sorted. A key that keeps the entries
+// so far lets the sort finish.
+static bool sort_files(std::vector<DIRINFO> &files, INTERRUPT &interrupt)
+{
+    const size_t run = 1 << 16;
+    const size_t n = files.size();
+    for (size_t i = 0; i < n; i += run)
+    {
+        if (interrupt.poll() && interrupt.abandoned())
+            return false;
+        std::sort(files.begin() + i, files.begin() + std::min(i + run, n));
+    }
+    for (size_t width = run; width < n; width *= 2)
+    {
+        for (size_t i = 0; i + width < n; i += 2*width)
+        {
+            if (interrupt.poll() && interrupt.abandoned())
+                return false;
+            std::inplace_merge(files.begin() + i, files.begin() + i + width,
+                    files.begin() + std::min(i + 2*width, n));
+        }
+    }
+    return true;
+}
+
+// Rebuild the listing of the cwd. A key stops a rebuild that takes a
+// while: Escape goes back to the previous directory and listing, and
+// returns false, and other keys keep the entries listed so far.
+static bool rebuild()
+{
+    TRACE_SCOPE trace("rebuild");
+    PERFSAMPLE sample;
+    perf_begin(sample);
+    TIMER    timer(false);
+    double    buildtime;
+    double    sorttime;
+    double    layouttime;
+
+    // Set the hostname and username
+    gethostname(thehostname, BUFSIZE);
+
+    // Tags are kept while the listing of the same directory is rebuilt
+    const std::string prevcwd = thecwd;
+    std::vector<std::string> tagged;
+    if (thelisting == LISTING_DIRECTORY)
+        save_tags(tagged);
+
+    // Get the directory listing
+    if (!getcwd(thecwd, sizeof(thecwd)))
+    {
+        themsg = "Could not get current directory";
+        return true;
+    }
+
+    thefsguard.loadmounts();
+    uint64_t phase = TRACE::now();
+
+    // Read the directory under thefsguard, in case its filesystem has
+    // stopped responding. The worker fills a listing it shares ownership
+    // of, since it carries on after a timeout.
+    struct LISTING {
+        std::vector<DIRINFO> files;
+        bool opened;
+        bool unknown;
+        long fstype;
+        std::atomic<int> progress;
+        std::atomic<bool> stop;
+    };
+    std::shared_ptr<LISTING> listing(new LISTING);
+    listing->opened = false;
+    listing->unknown = false;
+    listing->fstype = 0;
+    listing->progress = 0;
+    listing->stop = false;
+
+    // Going back is only possible from a previous directory
+    INTERRUPT interrupt;
+    const FSPROFILE *prevprofile = thefsprofile;
+    auto abandon = [&]()
+    {
+        if (prevcwd.empty() || !interrupt.abandoned())
+            return false;
+        thefsprofile = prevprofile;
+        if (prevcwd != thecwd && !guarded_chdir(prevcwd.c_str()))
+            snprintf(thecwd, sizeof(thecwd), "%s", prevcwd.c_str());
+        themsg = "Cancelled";
+        return true;
+    };
+
+    const std::string cwd = thecwd;
+    const std::map<std::string, IGNOREMASK> masks = theignoremask;
+    const bool listed = thefsguard.run(cwd, [listing, cwd, masks]()
+    {
+        DIR *dp = opendir(cwd.c_str());
+        if (dp == NULL)
+            return;
+        listing->opened = true;
+        listing->fstype = fstype(dp);
+
+        const struct dirent *result = readdir(dp);
+        while(result && !listing->stop)
+        {
+            if (strcmp(result->d_name, ".") &&
+                strcmp(result->d_name, "..") &&
+                !ignored(result->d_name, masks))
+            {
+                listing->files.push_back(DIRINFO());
+                listing->files.back().setname(result->d_name);
+
+                if (result->d_type == DT_DIR)
+                {
+                    listing->files.back().setdirectory();
+                }
+                else if (result->d_type == DT_UNKNOWN)
+                {
+                    listing->files.back().setunknown();
+                    listing->unknown = true;
+                }
+            }
+            if (!(listing->files.size() % 1024))
+                listing->progress++;
+            result = readdir(dp);
+        }
+
+        closedir(dp);
+    }, &listing->progress, [&]()
+    {
+        if (interrupt.poll())
+            listing->stop = true;
+    });
+    trace_phase("rebuild.readdir", phase);
+
+    if (abandon())
+        return false;
+
+    if (!listed)
+    {
+        // Keep showing the listing, marked stale, so that the user can
+        // still climb or jump away
+        themsg = cwd + ": Not responding";
+        if (prevcwd == thecwd && thelisting == LISTING_DIRECTORY)
+        {
+            for (auto it = thefiles.begin(); it != thefiles.end(); ++it)
+                it->setstale();
+            damage();
+            return true;
+        }
+    }
+    else if (!listing->opened)
+    {
+        themsg = "Could not get directory listing";
+        return true;
+    }
+
+    // The new entries are gathered, stat'ed and sorted aside, so that the
+    // current listing stays if the rebuild is abandoned. The worker is
+    // done with the listing unless it timed out.
+    std::vector<DIRINFO> files;
+    bool unknown = false;
+    if (listed)
+    {
+        files.swap(listing->files);
+        unknown = listing->unknown;
+        thefsprofile = &fsprofile(listing->fstype);
+    }
+
+    // Sorting by size or time needs stat data for every file, as does
+    // sorting directories first on filesystems that don't report the file
+    // type, so gather it up front in parallel
+    if (thedetail != DETAIL_NONE || unknown)
+    {
+        if (!parallel_stat(files, &interrupt) && !interrupt.abandoned())
+            themsg = std::string(thecwd) + ": Not responding";
+        trace_phase("rebuild.stat", phase);
+
+        if (abandon())
+            return false;
+    }
+
+    if (thedebugmode)
+        buildtime = timer.elapsed();
+
+    sort_files(files, interrupt);
+    if (abandon())
+        return false;
+
+    if (interrupt.stopped())
+    {
+        themsg = "Stopped after " + std::to_string(files.size()) +
+            " entries";
+    }
+
+    thetags.clear();
+
+    // Refresh when entries are added or removed. The directory was just
+    // read, so adding the watch won't block on its filesystem.
+    if (listed)
+        theevents.watch(thecwd);
+
+    // Save the current file name
+    std::string prevfile;
+    if (thelisting == LISTING_GREP)
+    {
+        // Leaving search results restores the selection in the directory
+        thegrep.reset();
+        thelisting = LISTING_DIRECTORY;
+        prevfile = thesavedcurfile[thecwd];
+    }
+    else if (thecurfile < nfiles())
+        prevfile = getfile(thecurfile).name();
+
+    thefiles.swap(files);
+    thestats.reset();
+
+    // The cached listing for completion is rebuilt from thefiles when needed
+    thelistings.erase(thecwd);
+
+    if (prevcwd == thecwd)
+        restore_tags(tagged);
+
+    evaluate_query();
+    build_view();
+
+    // Restore the current file if possible. This allows reordering (eg.
+    // toggling details or refreshing the directory) to preserve the
+    // selection.
+    if (!prevfile.empty())
+        find_and_set_curfile(prevfile);
+
+    if (thecurfile >= nfiles())
+        thecurfile = nfiles() ? nfiles()-1 : 0;
+
+    if (thedebugmode)
+        sorttime = timer.elapsed();
+    trace_phase("rebuild.sort", phase);
+
+    layout();
+    trace_phase("rebuild.layout", phase);
+
+    perf_end(sample);
+    therebuildperf = sample;
+
+    if (thedebugmode)
+    {
+        layouttime = timer.elapsed();
+
+        char buf[BUFSIZE];
+        sprintf(buf, "build time: %f sort time: %f layout time %f",
+                buildtime,
+                sorttime-buildtime,
+                layouttime-sorttime);
+        themsg = buf;
+    }
+    return true;
+}
+
+static void redraw()
+{
+    rebuild();
+}
+
+static int file_color(const DIRINFO &dir, bool tagged)
+{
+    int color = 0; // Black
+    for (int i = 0; i < thecolors.size(); i++)
+    {
+        switch (thecolors[i].mytype)
+        {
+            case COLOR::DIRECTORY:
+                if (dir.isdirectory())
+                {
+                    color = thecolors[i].mycolor;
+                }
+                break;
+            case COLOR::EXECUTABLE:
+                if (!dir.isdirectory() && dir.hasstat() && dir.isexecute())
+                {
+                    color = thecolors[i].mycolor;
+                }
+                break;
+            case COLOR::READONLY:
+                if (!dir.isdirectory() && dir.hasstat() && !dir.iswrite())
+                {
+                    color = thecolors[i].mycolor;
+                }
+                break;
+            case COLOR::LINK:
+                // The type of a directory is known, so it isn't a link
+                if (!dir.isdirectory() && dir.hasstat() && dir.islink())
+                {
+                    color = thecolors[i].mycolor;
+                }
+                break;
+            case COLOR::TAGGED:
+                if (tagged)
+                {
+                    color = thecolors[i].mycolor;
+                }
+                break;
+            case COLOR::PATTERN:
+                if (!fnmatch(thecolors[i].mypattern.c_str(),
+                            dir.name().c_str(), FNM_PERIOD))
+                {
+                    color = thecolors[i].mycolor;
+                }
+                break;
+        }
+    }
+
+    return color;
+}
+
+// Whether any color rules depend on stat data
+static bool stat_colors()
+{
+    for (int i = 0; i < thecolors.size(); i++)
+    {
+        switch (thecolors[i].mytype)
+        {
+            case COLOR::EXECUTABLE:
+            case COLOR::READONLY:
+            case COLOR::LINK:
+                return true;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+// The attribute for an entry. Until the stat data for a file arrives, it is
+// dimmed rather than guessing at a color that depends on it, as is an entry
+// on a filesystem that stopped responding. A tagged entry has the tagged
+// color (if any) meanwhile.
+static chtype file_attr(const DIRINFO &dir, bool tagged)
+{
+    if (dir.isstale())
+        return A_DIM;
+    if (!dir.isdirectory() && !dir.hasstat() && stat_colors() && !tagged)
+        return A_DIM;
+    return COLOR_PAIR(file_color(dir, tagged));
+}
+
+// Whether the stat data for an entry is needed to draw it: for colors, for
+// the detail column, or to tell whether it's a directory
+static bool needs_stat(const DIRINFO &dir)
+{
+    if (dir.hasstat())
+        return false;
+    if (dir.isunknown() || thedetail != DETAIL_NONE)
+        return true;
+    return !dir.isdirectory() && stat_colors();
+}
+
+static void putstr(std::vector<chtype> &row, const char *str, chtype attr)
+{
+    for (; *str; str++)
+        row.push_back((unsigned char)*str | attr);
+}
+
+static void puttime(std::vector<chtype> &row, const char *format, struct tm &time)
+{
+    char date[BUFSIZE];
+
+    strftime(date, BUFSIZE, format, &time);
+    putstr(row, date, A_NORMAL);
+}
+
+static void putpunc(std::vector<chtype> &row, char c)
+{
+    row.push_back((unsigned char)c | COLOR_PAIR(4));
+}
+
+// The time the current frame is drawn at
+static time_t thedrawtime = 0;
+
+// The relative times in DETAIL_TIME are shown to the second within the last
+// hour. Otherwise the row only depends on the date, so it is recomposed at
+// most once a minute. Owner and group rows are recomposed as names arrive.
+static time_t row_epoch(const DIRINFO &dir)
+{
+    if (thedetail == DETAIL_OWNER || thedetail == DETAIL_GROUP)
+        return theidnames.generation();
+    if (thedetail != DETAIL_TIME)
+        return 0;
+    if (thedrawtime - dir.modtime() < 60*60)
+        return thedrawtime;
+    return thedrawtime - thedrawtime % 60;
+}
+
+// Compose the details and name for an entry
+static void compose_row(const DIRINFO &dir, bool tagged, ROWCACHE &cache)
+{
+    std::vector<chtype> &row = cache.myrow;
+    row.clear();
+
+    const chtype color = file_attr(dir, tagged);
+
+    switch (thedetail)
+    {
+        case DETAIL_NONE:
+            // Draw the '*' for directories
+            row.push_back(dir.isdirectory() ? '*' | color : ' ');
+            row.push_back(' ');
+            break;
+        case DETAIL_SIZE:
+            {
+                // Draw the file size. Blocks of 3 digits will alternate in
+                // color.
+                row.assign(thedetailsizewidth + 2, ' ');
+
+                // Nothing but the name is known of a stale entry, or of one
+                // whose stat data has yet to arrive
+                if (dir.isstale() || !dir.hasstat())
+                {
+                    row[thedetailsizewidth-1] = '?' | A_DIM;
+                    break;
+                }
+
+                bool color = true;
+                int i = 0;
+                size_t s = dir.size();
+                do
+                {
+                    if (!(i % 3))
+                        color = !color;
+                    row[thedetailsizewidth-i-1] =
+                        ((s % 10) + '0') | (color ? COLOR_PAIR(4) : A_NORMAL);
+                    s /= 10;
+                    i++;
+                } while (s && i < thedetailsizewidth);
+            }
+            break;
+        case DETAIL_TIME:
+            {
+                if (dir.isstale() || !dir.hasstat())
+                {
+                    row.assign(thedetailtimewidth + 2, ' ');
+                    row[thedetailtimewidth-1] = '?' | A_DIM;
+                    break;
+                }
+
+                // Draw the modification time
+                time_t modtime = dir.modtime();
+                time_t nowtime = thedrawtime;
+                time_t yestime = nowtime - 60*60*24;
+                struct tm modtm;
+                struct tm nowtm;
+                struct tm yestm;
+
+                localtime_r(&modtime, &modtm);
+                localtime_r(&nowtime, &nowtm);
+                localtime_r(&yestime, &yestm);
+
+                if (nowtm.tm_mday == modtm.tm_mday &&
+                    nowtm.tm_mon == modtm.tm_mon &&
+                    nowtm.tm_year == modtm.tm_year)
+                {
+                    putstr(row, "    Today", A_NORMAL);
+                }
+                else if (yestm.tm_mday == modtm.tm_mday &&
+                         yestm.tm_mon == modtm.tm_mon &&
+                         yestm.tm_year == modtm.tm_year)
+                {
+                    putstr(row, "Yesterday", A_NORMAL);
+                }
+                else
+                {
+                    puttime(row, "%b %d", modtm);
+                    putpunc(row, '/');
+                    puttime(row, "%g", modtm);
+                }
+
+                char buf[BUFSIZE];
+                time_t difftime = nowtime - modtime;
+                if (difftime == 0)
+                {
+                    putstr(row, "      now", A_NORMAL);
+                }
+                else if (difftime < 60)
+                {
+                    snprintf(buf, BUFSIZE, "      %03d", -(int)difftime);
+                    putstr(row, buf, A_NORMAL);
+                }
+                else if (difftime < 3600)
+                {
+                    snprintf(buf, BUFSIZE, "   %3d", -(int)(difftime/60));
+                    putstr(row, buf, A_NORMAL);
+                    putpunc(row, ':');
+                    snprintf(buf, BUFSIZE, "%02d", (int)(difftime%60));
+                    putstr(row, buf, A_NORMAL);
+                }
+                else
+                {
+                    puttime(row, " %k", modtm);
+                    putpunc(row, ':');
+                    puttime(row, "%M", modtm);
+                    putpunc(row, ':');
+                    puttime(row, "%S", modtm);
+                }
+
+                row.resize(thedetailtimewidth, ' ');
+                row.push_back(' ');
+                row.push_back(' ');
+            }
+            break;
+        case DETAIL_OWNER:
+        case DETAIL_GROUP:
+            {
+                if (dir.isstale() || !dir.hasstat())
+                {
+                    row.assign(thedetailidwidth + 2, ' ');
+                    row[0] = '?' | A_DIM;
+                    break;
+                }
+
+                // The id is shown dimmed until its name arrives. Names that
+                // don't fit are cut short with a '+'.
+                std::string name;
+                const bool known = thedetail == DETAIL_OWNER ?
+                    theidnames.name(IDNAMES::USER, dir.uid(), name) :
+                    theidnames.name(IDNAMES::GROUP, dir.gid(), name);
+                if (name.length() > thedetailidwidth)
+                {
+                    name.resize(thedetailidwidth);
+                    name.back() = '+';
+                }
+                putstr(row, name.c_str(), known ? A_NORMAL : A_DIM);
+
+                row.resize(thedetailidwidth, ' ');
+                row.push_back(' ');
+                row.push_back(' ');
+            }
+            break;
+    }
+
+    // Mark tagged entries in the space before the name
+    if (tagged)
+        row.back() = '+' | A_BOLD;
+
+    cache.mynamestart = row.size();
+    putstr(row, dir.name().c_str(), color);
+}
+
+// Get the composed row for an entry, composing it if the cached row is out
+// of date
+static const ROWCACHE &getrow(const DIRINFO &dir, bool tagged)
+{
+    std::shared_ptr<ROWCACHE> &cache = dir.rowcache();
+    const time_t epoch = row_epoch(dir);
+
+    if (!cache)
+        cache.reset(new ROWCACHE);
+    else if (cache->mydetail == thedetail &&
+            cache->mysizewidth == thedetailsizewidth &&
+            cache->myepoch == epoch &&
+            cache->mytagged == tagged)
+        return *cache;
+
+    cache->mydetail = thedetail;
+    cache->mysizewidth = thedetailsizewidth;
+    cache->myepoch = epoch;
+    cache->mytagged = tagged;
+    compose_row(dir, tagged, *cache);
+
+    return *cache;
+}
+
+// Release the rows composed for a page that is no longer shown, so that
+// paging through a large directory doesn't keep a row for every entry
+static void release_rows(int page)
+{
+    int file = page * thecols * therows;
+    int maxfile = SYSmin(file + thecols * therows, nfiles());
+    for (; file < maxfile; file++)
+        getfile(file).rowcache().reset();
+}
+
+// Apply the stat data fetched by the workers. Returns whether any of it is
+// for an entry on the current page, or changed the layout.
+static bool apply_stats()
+{
+    std::vector<STATQUEUE::RESULT> results;
+    thestats.take(results);
+
+    const int first = thecurpage * thecols * therows;
+    const int last = first + thecols * therows;
+    bool visible = false;
+    for (auto it = results.begin(); it != results.end(); ++it)
+    {
+        DIRINFO &dir = thefiles[it->index];
+        auto pos = std::lower_bound(theview.begin(), theview.end(), it->index);
+        const bool inview = pos != theview.end() && *pos == it->index;
+
+        // The size column is as wide as the largest size in the view
+        if (inview)
+            thewidths.remove(dir);
+        dir.setstat(it->st);
+        if (inview)
+            thewidths.add(dir);
+
+        if (inview)
+        {
+            const int file = pos - theview.begin();
+            visible |= file >= first && file < last;
+        }
+    }
+
+    if (thedetail == DETAIL_SIZE && !results.empty() &&
+            SYSmax(thewidths.maxsize(), 1) != thedetailsizewidth)
+    {
+        layout(LINES-3, COLS);
+        filetopage();
+        visible = true;
+    }
+    return visible;
+}
+
+static void request_page(int page, int tier)
+{
+    if (page < 0 || page >= thepages)
+        return;
+
+    int file = page * thecols * therows;
+    int maxfile = SYSmin(file + thecols * therows, nfiles());
+    for (; file < maxfile; file++)
+    {
+        const DIRINFO &dir = getfile(file);
+        if (needs_stat(dir))
+            thestats.request(theview[file], dir.statpath(), tier);
+    }
+}
+
+// Queue the stat data needed to draw entries (see needs_stat()): the
+// current page, then the adjacent pages, then the rest of the directory
+// unless its filesystem's profile keeps to the pages around the current
+// one. The current page gets a brief grace period to arrive so that local
+// directories are drawn without placeholders.
+static void schedule_stats()
+{
+    request_page(thecurpage, 0);
+    request_page(thecurpage-1, 1);
+    request_page(thecurpage+1, 1);
+
+    if (thelisting == LISTING_DIRECTORY && thefsprofile->mystatall &&
+            (stat_colors() || thedetail != DETAIL_NONE) &&
+            !thestats.requestedall())
+    {
+        for (int i = 0; i < thefiles.size(); i++)
+        {
+            if (needs_stat(thefiles[i]))
+                thestats.request(i, thefiles[i].statpath(), 2);
+        }
+        thestats.setrequestedall();
+    }
+
+    thestats.wait(STATGRACE);
+    apply_stats();
+}
+
+static void drawfile(int file, const SPY_REGEX *incsearch)
+{
+    int page, x, y;
+    filetopage(file, page, x, y);
+
+    const int xoff = thepackcolumns ?
+        thecolx[file / therows] - thecolx[page * thecols] :
+        (x * COLS) / thecols;
+
+    const DIRINFO &dir = getfile(file);
+    const ROWCACHE &cache = getrow(dir, thetags.test(theview[file]));
+    const int namestart = cache.mynamestart;
+    const int len = SYSmin(cache.myrow.size(), SYSmax(COLS - xoff, 0));
+
+    if (file != thecurfile && !(HLSEARCH && incsearch))
+    {
+        mvaddchnstr(2+y, xoff, &cache.myrow[0], len);
+    }
+    else
+    {
+        // Overlay the current file and search highlight on a copy of the row
+        static std::vector<chtype> row;
+        row.assign(cache.myrow.begin(), cache.myrow.begin() + len);
+
+        if (file == thecurfile)
+        {
+            for (int i = namestart; i < len; i++)
+                row[i] = (row[i] & A_CHARTEXT) | COLOR_PAIR(0) | A_REVERSE;
+        }
+
+        int hlstart;
+        int hlend;
+        if (dir.match(incsearch, hlstart, hlend))
+        {
+            hlend = SYSmin(namestart + hlend, len);
+            for (int i = namestart + hlstart; i < hlend; i++)
+                row[i] = (row[i] & A_CHARTEXT) | COLOR_PAIR(8) | A_REVERSE;
+        }
+
+        mvaddchnstr(2+y, xoff, &row[0], len);
+    }
+
+    thecellswritten += len;
+
+    move(2+y, xoff + namestart - 1);
+}
+
+// Format a counter in 3 significant figures
+static std::string perf_count(uint64_t count)
+{
+    char buf[32];
+    if (count >= 1000000000)
+        snprintf(buf, sizeof(buf), "%.3gG", count / 1e9);
+    else if (count >= 1000000)
+        snprintf(buf, sizeof(buf), "%.3gM", count / 1e6);
+    else if (count >= 1000)
+        snprintf(buf, sizeof(buf), "%.3gk", count / 1e3);
+    else
+        snprintf(buf, sizeof(buf), "%d", (int)count);
+    return buf;
+}
+
+// Describe the listing and any filtering after the page number
+static void drawstatus()
+{
+    if (thelisting == LISTING_GREP)
+    {
+        printw("Grep '%s'%s  ", thegreppattern.c_str(),
+                thegrep ? " (searching)" : "");
+    }
+    if (!thefilter.empty())
+        printw("Filter '%s'  ", thefilter.c_str());
+    if (!thequerystr.empty())
+        printw("Query '%s'  ", thequerystr.c_str());
+    if (nfiles() != thefiles.size())
+        printw("%d/%d  ", nfiles(), (int)thefiles.size());
+
+    if (thefileop)
+    {
+        static const char *verbs[] = { "Copying", "Moving", "Deleting" };
+        printw("%s: %s files %sB%s  ", verbs[thefileop->type()],
+                perf_count(thefileop->files()).c_str(),
+                perf_count(thefileop->bytes()).c_str(),
+                thefileop->errors() ? " (errors)" : "");
+    }
+
+    int running, failed;
+    thejobs.counts(running, failed);
+    if (running)
+        printw("Jobs: %d running  ", running);
+    if (failed)
+        printw("Jobs: %d failed  ", failed);
+}
+
+static void drawmsg()
+{
+    if (!themsg.empty())
+    {
+        move(LINES-1, 0);
+        attrset(A_REVERSE);
+        addnstr(themsg.c_str(), COLS-1);
+        attrset(A_NORMAL);
+        thecellswritten += getcurx(stdscr);
+    }
+}
+
+static void drawtitle()
+{
+    char    title[BUFSIZE];
+
+    attrset(A_NORMAL);
+
+    move(0, 0);
+    int rval = snprintf(title, BUFSIZE, "%s@%s: %s", s_user, thehostname, thecwd);
+    assert(rval >= 0);
+    addnstr(title, COLS);
+    thecellswritten += getcurx(stdscr);
+}
+
+static std::string perf_sample(const char *label, const PERFSAMPLE &sample)
+{
+    static const char *names[PERFCOUNTERS::COUNT] = {
+        "cyc", "ins", "miss", "sys"
+    };
+
+    std::string str = label;
+    for (int i = 0; i < PERFCOUNTERS::COUNT; i++)
+    {
+        if (theperf.valid(i))
+            str += " " + perf_count(sample.counters[i]) + " " + names[i];
+    }
+    str += " " + perf_count(sample.stats) + " stat";
+    return str;
+}
+
+// Overlay the performance stats on the right of the title line
+static void drawoverlay()
+{
+    std::vector<double> latencies(thelatencies.begin(), thelatencies.end());
+    double p50 = 0, p99 = 0;
+    if (!latencies.empty())
+    {
+        const int n = latencies.size();
+        std::nth_element(latencies.begin(), latencies.begin() + n/2,
+                latencies.end());
+        p50 = latencies[n/2];
+        std::nth_element(latencies.begin(), latencies.begin() + n*99/100,
+                latencies.end());
+        p99 = latencies[n*99/100];
+    }
+
+    char buf[BUFSIZE];
+    snprintf(buf, BUFSIZE, "[p50 %.1fms p99 %.1fms %dfps]", p50, p99,
+            (int)theframes.size());
+
+    std::string overlay = buf;
+    overlay += " [" + perf_sample("rebuild", therebuildperf) + "]";
+    overlay += " [" + perf_sample("draw", thedrawperf) + "]";
+
+    move(0, 0);
+    clrtoeol();
+    drawtitle();
+
+    const int len = SYSmin((int)overlay.length(), COLS);
+    mvaddnstr(0, COLS - len, overlay.c_str() + overlay.length() - len, len);
+}
+
+// Show how much the last frame drew at the end of the status line
+static void drawstats(bool full)
+{
+    int y, x;
+    getyx(stdscr, y, x);
+
+    int files, opens, hits;
+    uint64_t used;
+    theprefetch.counts(files, opens, hits, used);
+
+    char buf[BUFSIZE];
+    snprintf(buf, BUFSIZE,
+            "[fs %s] [prefetch %d files %sB %d/%d hits] "
+            "[%s %6d cells %6d merged]", thefsprofile->myname,
+            files, perf_count(used).c_str(), hits, opens,
+            full ? "full" : "part", thecellswritten, themergedkeys);
+    attrset(A_NORMAL);
+    mvaddnstr(1, SYSmax(COLS - (int)strlen(buf), 0), buf, COLS);
+
+    if (theperfoverlay)
+        drawoverlay();
+
+    move(y, x);
+}
+
+static void draw(const SPY_REGEX *incsearch = 0)
+{
+    TRACE_SCOPE trace("draw");
+    PERFSAMPLE sample;
+    perf_begin(sample);
+
+    thecellswritten = 0;
+    thedrawtime = time(0);
+
+    const uint64_t now = TRACE::now();
+    theframes.push_back(now);
+    while (theframes.front() < now - 1000000000ull)
+        theframes.pop_front();
+
+    // Unless the screen was damaged or the page changed, only the previous
+    // and new current files (and the message) need to be redrawn
+    const bool full = thedamaged || incsearch ||
+        thecurpage != thedrawnpage || thedrawnfile >= nfiles() || !nfiles();
+
+    if (!full)
+    {
+        if (themsg != thedrawnmsg)
+        {
+            move(LINES-1, 0);
+            clrtoeol();
+            drawmsg();
+        }
+
+        if (thedrawnfile != thecurfile)
+            drawfile(thedrawnfile, 0);
+        drawfile(thecurfile, 0);
+
+        thedrawnfile = thecurfile;
+        thedrawnmsg = themsg;
+
+        if (thedebugmode)
+            drawstats(full);
+
+        perf_end(sample);
+        thedrawperf = sample;
+        return;
+    }
+
+    schedule_stats();
+
+    // Use erase() to clear the screen before drawing. Don't use clear(),
+    // since this will cause the next refresh() to clear the screen causing
+    // flicker.
+    erase();
+
+    drawtitle();
+
+    drawmsg();
+
+    if (thedrawnpage >= 0 && thedrawnpage != thecurpage)
+        release_rows(thedrawnpage);
+
+    // The search highlight must be cleared by the next frame
+    thedamaged = incsearch;
+    thedrawnpage = thecurpage;
+    thedrawnfile = thecurfile;
+    thedrawnmsg = themsg;
+
+    if (nfiles())
+    {
+        move(1, 0);
+        if (thepages > 1)
+            printw("Page %d/%d  ", thecurpage+1, thepages);
+        drawstatus();
+
+        int file = thecurpage * thecols * therows;
+        int maxfile = SYSmin((thecurpage+1) * thecols * therows, nfiles());
+        for (; file < maxfile; file++)
+        {
+            if (file != thecurfile)
+                drawfile(file, incsearch);
+        }
+
+        // Draw the current file last to leave the cursor in the expected
+        // place
+        drawfile(thecurfile, incsearch);
+    }
+    else
+    {
+        move(1, 0);
+        drawstatus();
+        printw(thefiles.size() || thelisting == LISTING_GREP ?
+                "<no matches>\n" : "<empty>\n");
+    }
+
+    if (thedebugmode)
+        drawstats(full);
+
+    perf_end(sample);
+    thedrawperf = sample;
+}
+
+static void ignoretoggle(const char *label)
+{
+    IGNOREMASK &mask = theignoremask[label];
+    mask.myenable = !mask.myenable;
+
+    rebuild();
+
+    themsg = mask.myenable ? "Enabled" : "Disabled";
+    themsg += " ignore mask '";
+    themsg += label;
+    themsg += "'";
+}
+
+static void detailtoggle()
+{
+    thedetail = (DETAIL_TYPE)((int)thedetail+1);
+    if (thedetail == DETAIL_MAX)
+        thedetail = DETAIL_NONE;
+
+    rebuild();
+
+    switch (thedetail)
+    {
+        case DETAIL_NONE: break;
+        case DETAIL_SIZE: themsg = "Sorted by file size"; break;
+        case DETAIL_TIME: themsg = "Sorted by modification time"; break;
+        case DETAIL_OWNER: themsg = "Sorted by owner"; break;
+        case DETAIL_GROUP: themsg = "Sorted by group"; break;
+    }
+}
+
+// Cycle between debug mode off, on, and on with the performance overlay
+static void debugmode()
+{
+    if (!thedebugmode)
+        thedebugmode = true;
+    else if (!theperfoverlay)
+    {
+        theperfoverlay = true;
+        theperf.open();
+    }
+    else
+    {
+        thedebugmode = false;
+        theperfoverlay = false;
+    }
+    damage();
+
+    themsg = !thedebugmode ? "Disabled debug mode" :
+        theperfoverlay ? "Enabled performance overlay" : "Enabled debug mode";
+}
+
+// Write the recent trace spans for a trace viewer
+static void tracedump()
+{
+    if (TRACE::instance().write(s_tracefile.c_str()))
+        themsg = "Wrote trace to " + s_tracefile;
+    else
+        themsg = "Could not write " + s_tracefile;
+}
+
+static int ncols()
+{
+    if (thecurpage < thepages-1)
+        return thecols;
+
+    int files = nfiles() - thecurpage*thecols*therows;
+    return (files + therows - 1 - thecurrow) / therows;
+}
+
+static int nrows()
+{
+    if (thecurpage < thepages-1)
+        return therows;
+
+    int files = nfiles() - thecurpage*thecols*therows;
+    files -= thecurcol * therows;
+    if (files >= therows)
+        return therows;
+    if (files < 0)
+        return 0;
+    return files;
+}
+
+static void left()
+{
+    thecurcol--;
+    if (thecurcol < 0)
+        thecurcol = ncols()-1;
+    pagetofile();
+}
+
+static void right()
+{
+    thecurcol++;
+    if (thecurcol >= ncols())
+        thecurcol = 0;
+    pagetofile();
+}
+
+static void up()
+{
+    thecurrow--;
+    if (thecurrow < 0)
+        thecurrow = nrows()-1;
+    pagetofile();
+}
+
+static void down()
+{
+    thecurrow++;
+    if (thecurrow >= nrows())
+        thecurrow = 0;
+    pagetofile();
+}
+
+static bool spy_chdir(const char *dir)
+{
+    if (guarded_chdir(dir))
+    {
+        char    buf[BUFSIZE];
+        themsg = errno == ETIMEDOUT ? std::string(dir) + ": Not responding" :
+            strerror_r(errno, buf, BUFSIZE);
+        return false;
+    }
+
+    // Check if the directory really changed before invoking rebuild(),
+    // since special characters like '.' are handled directly by chdir.
+    char cwd[FILENAME_MAX];
+    if (!getcwd(cwd, sizeof(cwd)) || !strcmp(cwd, thecwd))
+        return false;
+
+    // Save the current file
+    if (thelisting == LISTING_DIRECTORY && thecurfile < nfiles())
+        thesavedcurfile[thecwd] = getfile(thecurfile).name();
+
+    // Save a copy of the directory name that we were just in (for
+    // ".." handling below)
+    std::string prevdir = thecwd;
+    std::string prevparent;
+    const size_t slashpos = prevdir.rfind('/');
+    if (slashpos != std::string::npos)
+    {
+        prevparent = prevdir.substr(0, slashpos);
+        prevdir = prevdir.substr(slashpos+1, prevdir.length()-slashpos-1);
+    }
+
+    // Keep the listing we're leaving for completion
+    cache_listing();
+
+    // Filters and queries apply to a single directory
+    const std::string filter = thefilter;
+    const std::string querystr = thequerystr;
+    const QUERY query = thequery;
+    thefilter.clear();
+    thequerystr.clear();
+    thequery.clear();
+
+    if (!rebuild())
+    {
+        // Back in the previous directory, with its listing unchanged
+        thefilter = filter;
+        thequerystr = querystr;
+        thequery = query;
+        return true;
+    }
+
+    thefrecency.visit(thecwd, time(0));
+
+    if (!strcmp(dir, "..") ||
+        !strcmp(dir, prevparent.c_str()))
+    {
+        // Special case for ".." - in this case, I would like to see
+        // the directory that we just came from as the current file.
+        find_and_set_curfile(prevdir);
+    }
+    else
+    {
+        // Restore the previous file, if it existed
+        auto it = thesavedcurfile.find(cwd);
+        if (it != thesavedcurfile.end())
+            find_and_set_curfile(it->second);
+    }
+
+    return true;
+}
+
+// Expand ~ and variables in a path
+static std::string expand_path(const char *path)
+{
+    std::string expanded = path;
+
+    wordexp_t p;
+    if (!wordexp(path, &p, 0))
+    {
+        // Use the first valid expansion
+        for (int i = 0; i < p.we_wordc; i++)
+        {
+            if (p.we_wordv[i])
+            {
+                expanded = p.we_wordv[i];
+            }
+        }
+        wordfree(&p);
+    }
+
+    return expanded;
+}
+
+static bool spy_jump_dir(const char *dir)
+{
+    return spy_chdir(expand_path(dir).c_str());
+}
+
+static void jump_dir(const char *dir)
+{
+    spy_jump_dir(dir);
+
+    draw();
+    refresh();
+}
+
+static void dirup()
+{
+    // Climbing out of search results returns to the directory
+    if (thelisting == LISTING_GREP)
+    {
+        rebuild();
+        return;
+    }
+
+    if (!spy_chdir(".."))
+    {
+        themsg = "No parent directory";
+    }
+}
+
+enum PROMPT_TYPE {
+    // Stay in curses mode after executing the command. If there was
+    // output, it won't be visible. This mode should only be used for
+    // commands that don't require user input.
+    PROMPT_SILENT,
+
+    // Leave curses mode to show output, but return to curses mode
+    // immediately after the command completes. This allows for interactive
+    // commands to use the terminal but to return immediately to curses
+    // mode when they complete.
+    PROMPT_INTERACTIVE,
+
+    // Leave curses mode and wait for input before returning to curses
+    // mode. This mode shows the 'continue' prompt in termcap, without
+    // returning to curses mode - so that the command output is visible
+    // even after the command completes.
+    PROMPT_CONTINUE,
+
+    // Run the command as a background job, without leaving curses mode.
+    // Its output is captured and can be seen from the job list.
+    PROMPT_BACKGROUND
+};
+
+template <PROMPT_TYPE> static void execute_command(const char *);
+static void open_match(const char *program);
+
+// The absolute path of the current file (the matching file of a content
+// search), or empty if there isn't one
+static std::string current_path()
+{
+    if (thecurfile >= nfiles())
+        return std::string();
+    const std::string path = getfile(thecurfile).path();
+    return path[0] == '/' ? path : std::string(thecwd) + "/" + path;
+}
+
+// Prefetch the current file once the cursor rests on it
+static void prefetch_current()
+{
+    if (thecurfile < nfiles() && !getfile(thecurfile).isdirectory() &&
+            thefsprofile->myprefetch)
+        theprefetch.request(current_path(),
+                (uint64_t)thefsprofile->myprefetch << 10);
+    else
+        theprefetch.cancel();
+}
+
+// Count the opening of the current file for the prefetch hit rate
+static void prefetch_opened()
+{
+    if (thecurfile < nfiles() && !getfile(thecurfile).isdirectory())
+        theprefetch.opened(current_path());
+}
+
+static void dirdown_enter()
+{
+    prefetch_opened();
+
+    if (thelisting == LISTING_GREP)
+    {
+        open_match(s_editor ? s_editor : "vim");
+        return;
+    }
+
+    if (!spy_chdir(getfile(thecurfile).name().c_str()))
+    {
+        themsg.clear();
+        std::string cmd = s_editor ? s_editor : "vim";
+        cmd += " %";
+        execute_command<PROMPT_SILENT>(cmd.c_str());
+    }
+}
+
+// Show files with the built-in viewer rather than $PAGER
+static bool theinternalviewer = false;
+
+static void view();
+
+static void dirdown_display()
+{
+    if (theinternalviewer)
+    {
+        view();
+        return;
+    }
+
+    prefetch_opened();
+
+    if (thelisting == LISTING_GREP)
+    {
+        open_match(s_pager ? s_pager : "less");
+        return;
+    }
+
+    if (!spy_chdir(getfile(thecurfile).name().c_str()))
+    {
+        themsg.clear();
+        std::string cmd = s_pager ? s_pager : "less";
+        cmd += " %";
+        execute_command<PROMPT_SILENT>(cmd.c_str());
+    }
+}
+
+static void pageup()
+{
+    if (thecurpage > 0)
+    {
+        thecurpage--;
+        thecurfile -= therows * thecols;
+    }
+}
+static void pagedown()
+{
+    if (thecurpage < thepages-1)
+    {
+        thecurpage++;
+        thecurfile += therows * thecols;
+        if (thecurfile >= nfiles())
+        {
+            thecurfile = nfiles()-1;
+            filetopage();
+        }
+    }
+}
+
+static void firstfile()
+{
+    thecurfile = 0;
+    filetopage();
+}
+
+static void lastfile()
+{
+    thecurfile = nfiles() ? nfiles()-1 : 0;
+    filetopage();
+}
+
+// The tagged files, or the current file if none are tagged, as indices into
+// thefiles
+static void selected_files(std::vector<int> &files)
+{
+    thetags.indices(files);
+    if (files.empty() && thecurfile < nfiles())
+        files.push_back(theview[thecurfile]);
+}
+
+static void tag_message()
+{
+    char buf[BUFSIZE];
+    snprintf(buf, BUFSIZE, "%d tagged", thetags.count());
+    themsg = buf;
+}
+
+// Toggle the tag on the current file and move to the next file
+static void take()
+{
+    if (thecurfile >= nfiles())
+        return;
+
+    thetags.toggle(theview[thecurfile]);
+    if (thecurfile < nfiles()-1)
+    {
+        thecurfile++;
+        filetopage();
+    }
+    tag_message();
+}
+
+// Tag the files that match the current search, or all the files in the
+// view if there's no search
+static void tagall()
+{
+    for (int file = 0; file < nfiles(); file++)
+    {
+        if (!thesearch || getfile(file).match(thesearch.get()))
+            thetags.set(theview[file], true);
+    }
+    damage();
+    tag_message();
+}
+
+static void untag()
+{
+    thetags.clear();
+    damage();
+    themsg = "Cleared tags";
+}
+
+static void setenv()
+{
+    themsg = "setenv not implemented";
+}
+
+static void ignore()
+{
+}
+
+// Read a key. Unless block is set, ERR is returned when no input is
+// waiting.
+static int spy_getchar(bool block = true)
+{
+    int ch;
+
+    if (thepushedkey != ERR)
+    {
+        ch = thepushedkey;
+        thepushedkey = ERR;
+        return ch;
+    }
+
+    if (theheadless)
+    {
+        while (!thescriptkeys.empty() && thescriptkeys.front() == SCRIPT_WAIT)
+            thescriptkeys.pop_front();
+        if (thescriptkeys.empty())
+        {
+            if (!block)
+                return ERR;
+            fprintf(stderr, "error: Key script ended at a prompt\n");
+            exit(1);
+        }
+
+        ch = thescriptkeys.front();
+        thescriptkeys.pop_front();
+        return ch;
+    }
+
+    if (isendwin())
+    {
+        // Set raw mode for stdin temporarily so that we can read a single
+        // character of unbuffered input.
+        struct termios old_settings;
+        struct termios new_settings;
+
+        tcgetattr(0, &old_settings);
+
+        new_settings = old_settings;
+        cfmakeraw (&new_settings);
+        tcsetattr (0, TCSANOW, &new_settings);
+
+        ch = getchar();
+
+        tcsetattr (0, TCSANOW, &old_settings);
+
+        if (ch == '\n' || ch == '\r')
+            ch = '\n';
+
+        // Hack to allow the arrow keys and delete to work in vi insert mode.
+        // Unfortunately, this breaks ESC (you have to hit it twice)
+        if (ch == ESC && rl_editing_mode == 0)
+        {
+            int ch2 = getchar();
+            if (ch2 == '[')
+            {
+                int ch3 = getchar();
+                switch (ch3)
+                {
+                    case 'A':
+                        ch = KEY_UP; break;
+                    case 'B':
+                        ch = KEY_DOWN; break;
+                    case 'C':
+                        ch = KEY_RIGHT; break;
+                    case 'D':
+                        ch = KEY_LEFT; break;
+                    case '3':
+                        {
+                            int ch4 = getchar();
+                            if (ch4 == '~')
+                            {
+                                ch = KEY_DC;
+                                break;
+                            }
+                            ungetc(ch4, stdin);
+                        }
+                    default:
+                        ungetc(ch3, stdin);
+                        ungetc(ch2, stdin);
+                        break;
+                }
+            }
+            else
+            {
+                ungetc(ch2, stdin);
+            }
+        }
+    }
+    else
+    {
+        // Curses input. Curses doesn't block (see init_curses()), so wait
+        // for input here, handling any signals that arrive meanwhile.
+        ch = getch();
+        while (ch == ERR && block)
+        {
+            std::vector<int> signals;
+            theevents.waitinput(signals);
+            handle_signals(signals);
+            ch = getch();
+        }
+    }
+
+    return ch;
+}
+
+// Hackery to keep track of whether we're in vi command mode, since
+// readline does not provide this state flag.
+static bool thecommandmode = false;
+
+static int spy_rl_getc(FILE *fp)
+{
+    int key = spy_getchar();
+
+    switch (key)
+    {
+        case '\b':
+        case KEY_BACKSPACE:
+        case RUBOUT:
+            if (!rl_point)
+            {
+                // Backspace past the prompt cancels the command in spy
+                *rl_line_buffer = '\0';
+                key = EOF;
+            }
+            else
+            {
+                key = '\b'; // Backspace character
+            }
+            break;
+
+        case ERR:
+            key = 0;
+            break;
 
         case 'a':
         case 'A':
@@ -1231,527 +6305,1715 @@ static int spy_rl_getc(FILE *fp)
             thecommandmode = false;
             break;
 
-        case ESC:
-        case KEY_DC:
-            key = ESC;
-            thecommandmode = true;
-            break;
-        //case KEY_DC:    key = 0; rl_delete(1, 0); break;
+        case ESC:
+        case KEY_DC:
+            key = ESC;
+            thecommandmode = true;
+            break;
+        //case KEY_DC:    key = 0; rl_delete(1, 0); break;
+
+        // For the rl_display function to be called, we have to return
+        // something - so return a null key (and assume readline ignores it
+        // and refreshes the display).
+        case KEY_UP:    key = 0; rl_get_previous_history(1, 0); break;
+        case KEY_DOWN:  key = 0; rl_get_next_history(1, 0); break;
+        case KEY_RIGHT: key = 0; rl_forward_char(1, 0); break;
+        case KEY_LEFT:  key = 0; rl_backward_char(1, 0); break;
+    }
+    return key;
+}
+
+enum RLTYPE {
+    JUMP,
+    SEARCHNEXT,
+    SEARCHPREV,
+    FILTER,
+    EXECUTE,
+    VIEWER
+};
+
+template <RLTYPE TYPE>
+static inline int nextfile(int file) { return file < nfiles()-1 ? file+1 : 0; }
+
+template <>
+inline int nextfile<SEARCHPREV>(int file) { return file > 0 ? file-1 : nfiles()-1; }
+
+template <RLTYPE TYPE>
+static void searchnext()
+{
+    if (!thesearch)
+        return;
+
+    // Only search files other than thecurfile
+    int file;
+    for (file = nextfile<TYPE>(thecurfile); file != thecurfile; file = nextfile<TYPE>(file))
+    {
+        if (getfile(file).match(thesearch.get()))
+            break;
+    }
+
+    if (file != thecurfile)
+    {
+        thecurfile = file;
+        filetopage();
+    }
+}
+
+static char s_termcap_buf[2048];
+
+static char *s_mr = 0;
+static char *s_md = 0;
+static char *s_me = 0;
+static char *s_cr = 0;
+static char *s_ce = 0;
+static char *s_cm = 0;
+static char *s_cd = 0;
+
+static void init_termcap()
+{
+    char *ptr = s_termcap_buf;
+
+    s_mr = tgetstr ("mr", &ptr); // Enter reverse mode
+    s_md = tgetstr ("md", &ptr); // Enter bold mode
+    s_me = tgetstr ("me", &ptr); // Exit all formatting modes
+    s_cr = tgetstr ("cr", &ptr); // Move to start of line
+    s_ce = tgetstr ("ce", &ptr); // Clear to end of line
+    s_cm = tgetstr ("cm", &ptr); // Cursor movement
+    s_cd = tgetstr ("cd", &ptr); // Clear to end of screen
+}
+
+static int thepromptline = 0;
+
+template <RLTYPE TYPE>
+static void spy_rl_display()
+{
+    TRACE_SCOPE trace("prompt.display");
+    int cmdlines = (strlen(rl_prompt) + strlen(rl_line_buffer)) / COLS;
+    int curscol = strlen(rl_prompt) + rl_point;
+    int cursline = curscol / COLS;
+
+    curscol -= cursline * COLS;
+
+    if (!isendwin())
+    {
+        if ((TYPE == SEARCHNEXT || TYPE == SEARCHPREV)
+               && rl_line_buffer && *rl_line_buffer)
+        {
+            // Temporarily replace the current file to show what was found
+            int prevfile = thecurfile;
+
+            thesearch.reset(new SPY_REGEX(rl_line_buffer));
+            searchnext<TYPE>();
+
+            draw(thesearch.get());
+
+            thesearch.reset(0);
+
+            thecurfile = prevfile;
+            filetopage();
+        }
+        else if (TYPE == FILTER)
+        {
+            // Narrow the view as the filter is typed
+            setfilter(rl_line_buffer);
+            draw();
+        }
+        else if (TYPE == VIEWER)
+        {
+            theviewer->draw(0);
+        }
+        else
+        {
+            draw();
+        }
+
+        attrset(A_NORMAL);
+
+        // Show where a fragment of a directory name would jump to
+        if (TYPE == JUMP && rl_line_buffer && *rl_line_buffer &&
+                !strchr("/~.$", *rl_line_buffer))
+        {
+            const std::string *match =
+                thefrecency.find(rl_line_buffer, thecwd, time(0));
+            if (match)
+            {
+                move(LINES-2-cmdlines, 0);
+                clrtoeol();
+                addstr("-> ");
+                addnstr(match->c_str(), COLS-4);
+            }
+        }
+
+        // Print the prompt
+        move(LINES-1-cmdlines, 0);
+        addstr(rl_prompt);
+        addstr(rl_line_buffer);
+
+        // Move to the cursor position
+        move(LINES-1-cmdlines+cursline, curscol);
+
+        // Change the cursor color when we're in vi command mode
+        if (rl_editing_mode == 0 && thecommandmode)
+            chgat(1, A_NORMAL, 8, NULL);
+
+        refresh();
+
+        // The prompt must be erased by the next frame
+        damage();
+    }
+    else
+    {
+        tputs(tgoto(s_cm, 0, thepromptline), 1, putchar);
+        tputs(s_cd, 1, putchar); // Necessary to clear lingering "Continue: "
+        tputs(rl_prompt, 1, putchar);
+        tputs(rl_line_buffer, 1, putchar);
+
+        thepromptline = SYSmin(thepromptline, (LINES-1) - cmdlines);
+        cursline += thepromptline;
+
+        // Move to the cursor position
+        tputs(tgoto(s_cm, curscol, cursline), 1, putchar);
+    }
+}
+
+static void add_unique_history(const char *command)
+{
+    for (int i = history_length; i-- > 0; )
+    {
+        // history_get() uses an offset of history_base
+        const char *line = history_get(history_base+i)->line;
+        if (!strcmp(line, command))
+        {
+            HIST_ENTRY *hist = remove_history(i);
+            free(hist->line);
+            free(hist);
+            break;
+        }
+    }
+
+    add_history(command);
+}
+
+static void continue_prompt(const char *status = 0)
+{
+    tputs(tgoto(s_cm, 0, LINES-1), 1, putchar);
+    tputs(s_mr, 1, putchar);
+    if (status && *status)
+    {
+        tputs(status, 1, putchar);
+        tputs(". ", 1, putchar);
+    }
+    tputs("Continue: ", 1, putchar);
+    tputs(s_me, 1, putchar);
+    tputs(s_ce, 1, putchar);
+}
+
+static void cancel_prompt()
+{
+    if (!isendwin())
+    {
+        draw();
+        refresh();
+    }
+    else
+    {
+        continue_prompt();
+    }
+}
+
+// Class to set and restore history state within a scope
+class HISTORY_SCOPE {
+public:
+    HISTORY_SCOPE(HISTORY_STATE &state) : mystate(state)
+    {
+        history_set_history_state(&mystate);
+    }
+    ~HISTORY_SCOPE()
+    {
+        HISTORY_STATE *tmp = history_get_history_state();
+        mystate = *tmp;
+        free(tmp);
+    }
+
+private:
+    HISTORY_STATE &mystate;
+};
+
+// Resolve input at the Jump prompt. Input that isn't a path or a
+// directory is treated as a fragment of a previously visited directory.
+static std::string resolve_jump(const std::string &dir)
+{
+    if (strchr("/~.$", dir[0]))
+        return dir;
+
+    struct stat st;
+    if (!guarded_stat(dir, st) && S_ISDIR(st.st_mode))
+        return dir;
+
+    const std::string *match = thefrecency.find(dir, thecwd, time(0));
+    return match ? *match : dir;
+}
+
+static void jump()
+{
+    HISTORY_SCOPE scope(s_jump_history);
+
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<JUMP>;
+
+    // Try to find a good default jump target in the recent history, that
+    // isn't the cwd.
+    std::string lastjump = "~";
+    for (int i = history_length; i-- > 0; )
+    {
+        // history_get() uses an offset of history_base
+        const char *line = history_get(history_base+i)->line;
+        if (strcmp(line, thecwd))
+        {
+            lastjump = line;
+            break;
+        }
+    }
+
+    // Read input
+    std::string prompt = "Jump:  (";
+    prompt += lastjump;
+    prompt += ") ";
+    char *input = readline(prompt.c_str());
+
+    if (input)
+    {
+        std::string dir = *input ? input : lastjump;
+        free(input);
+
+        // Store the current directory
+        add_unique_history(thecwd);
+
+        spy_jump_dir(resolve_jump(dir).c_str());
+
+        draw();
+        refresh();
+    }
+    else
+    {
+        cancel_prompt();
+    }
+}
+
+template <RLTYPE TYPE>
+static void search()
+{
+    HISTORY_SCOPE scope(s_search_history);
+
+    if (thesearch)
+    {
+        thesearch.reset(0);
+    }
+
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<TYPE>;
+
+    // Read input
+    char *search = readline("/");
+
+    if (search)
+    {
+        if (*search)
+        {
+            add_unique_history(search);
+
+            thesearch.reset(new SPY_REGEX(search));
+        }
+
+        free(search);
+
+        searchnext<TYPE>();
+
+        draw();
+        refresh();
+    }
+    else
+    {
+        cancel_prompt();
+    }
+}
+
+static int filter_startup_hook()
+{
+    // Start editing from the active filter so that it can be refined
+    rl_insert_text(thefilter.c_str());
+    return 0;
+}
+
+static void filterfiles()
+{
+    HISTORY_SCOPE scope(s_search_history);
+
+    std::string prevfilter = thefilter;
+
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<FILTER>;
+    rl_startup_hook = filter_startup_hook;
+
+    // Read input
+    char *filter = readline("Filter: ");
+
+    rl_startup_hook = 0;
+
+    if (filter)
+    {
+        if (*filter)
+            add_unique_history(filter);
+
+        setfilter(filter);
+        free(filter);
+
+        if (thefilter.empty())
+            themsg = "Cleared filter";
+
+        draw();
+        refresh();
+    }
+    else
+    {
+        setfilter(prevfilter);
+        cancel_prompt();
+    }
+}
+
+static int query_startup_hook()
+{
+    rl_insert_text(thequerystr.c_str());
+    return 0;
+}
+
+static void query()
+{
+    HISTORY_SCOPE scope(s_search_history);
+
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<EXECUTE>;
+    rl_startup_hook = query_startup_hook;
+
+    // Read input
+    char *query = readline("Query: ");
+
+    rl_startup_hook = 0;
+
+    if (query)
+    {
+        if (*query)
+            add_unique_history(query);
+
+        if (setquery(query) && !thequery.empty())
+        {
+            char buf[BUFSIZE];
+            snprintf(buf, BUFSIZE, "%d of %d entries match", nfiles(),
+                    (int)thefiles.size());
+            themsg = buf;
+        }
+        free(query);
+
+        draw();
+        refresh();
+    }
+    else
+    {
+        cancel_prompt();
+    }
+}
+
+static bool needs_quotes(const std::string &str)
+{
+    for (auto it = str.begin(); it != str.end(); ++it)
+    {
+        char c = *it;
+        if (!isalpha(c) && !isdigit(c) && c != '_' && c != '.' && c != '-')
+            return true;
+    }
+
+    return false;
+}
+
+static std::string quote_filename(std::string filename)
+{
+    if (needs_quotes(filename))
+    {
+        // Use strong quoting (''). This means that if there's a ' in the
+        // string, we have to close and then re-open the quote.
+        replaceall(filename, "'", "'\\''");
+        filename = std::string("'") + filename + "'";
+    }
+    return filename;
+}
+
+// Expand special command characters
+static std::string expand_command(const char *command)
+{
+    std::string expanded = command;
+
+    if (thecurfile < nfiles())
+    {
+        std::string filename = quote_filename(getfile(thecurfile).path());
+        replaceall_non_escaped(expanded, '%', filename);
+    }
+
+    return expanded;
+}
+
+static const char *signalname(int signal)
+{
+    switch (signal)
+    {
+        case SIGHUP:    return "SIGHUP";
+        case SIGINT:    return "SIGINT";
+        case SIGQUIT:    return "SIGQUIT";
+        case SIGILL:    return "SIGILL";
+        case SIGTRAP:    return "SIGTRAP";
+        case SIGABRT:    return "SIGABRT";
+        case SIGBUS:    return "SIGBUS";
+        case SIGFPE:    return "SIGFPE";
+        case SIGKILL:    return "SIGKILL";
+        case SIGUSR1:    return "SIGUSR1";
+        case SIGSEGV:    return "SIGSEGV";
+        case SIGUSR2:    return "SIGUSR2";
+        case SIGPIPE:    return "SIGPIPE";
+        case SIGALRM:    return "SIGALRM";
+        case SIGTERM:    return "SIGTERM";
+        case SIGSTKFLT:    return "SIGSTKFLT";
+        case SIGCHLD:    return "SIGCHLD";
+        case SIGCONT:    return "SIGCONT";
+        case SIGSTOP:    return "SIGSTOP";
+        case SIGTSTP:    return "SIGTSTP";
+        case SIGTTIN:    return "SIGTTIN";
+        case SIGTTOU:    return "SIGTTOU";
+        case SIGURG:    return "SIGURG";
+        case SIGXCPU:    return "SIGXCPU";
+        case SIGXFSZ:    return "SIGXFSZ";
+        case SIGVTALRM:    return "SIGVTALRM";
+        case SIGPROF:    return "SIGPROF";
+        case SIGWINCH:    return "SIGWINCH";
+        case SIGIO:        return "SIGIO";
+        case SIGPWR:    return "SIGPWR";
+        case SIGSYS:    return "SIGSYS";
+        default:        return strsignal(signal);
+    }
+}
+
+// Describe how a process exited, or return an empty string if it succeeded
+static std::string exit_string(int status)
+{
+    char buf[BUFSIZE];
+    if (WIFEXITED(status))
+    {
+        int exit_status = WEXITSTATUS(status);
+        if (exit_status)
+        {
+            snprintf(buf, BUFSIZE, "Exit status %d", exit_status);
+            return buf;
+        }
+    }
+    else if (WIFSIGNALED(status))
+    {
+        if (WCOREDUMP(status))
+            return "Core dumped";
+
+        snprintf(buf, BUFSIZE, "Terminated by %s", signalname(WTERMSIG(status)));
+        return buf;
+    }
+    return std::string();
+}
 
-        // For the rl_display function to be called, we have to return
-        // something - so return a null key (and assume readline ignores it
-        // and refreshes the display).
-        case KEY_UP:    key = 0; rl_get_previous_history(1, 0); break;
-        case KEY_DOWN:  key = 0; rl_get_next_history(1, 0); break;
-        case KEY_RIGHT: key = 0; rl_forward_char(1, 0); break;
-        case KEY_LEFT:  key = 0; rl_backward_char(1, 0); break;
+// Check if the shell name ends in csh. This will also catch tcsh.
+static bool iscsh(const char *shell)
+{
+    const int     shlen = strlen(shell);
+    return shlen >= 3 && !strncmp(shell+shlen-3, "csh", 3);
+}
+
+// Set theresized flag so that when curses is reentered the window size is set
+// correctly
+static void spy_endwin()
+{
+    endwin();
+    theresized = true;
+    damage();
+}
+
+// Strip a trailing & (but not &&) from a command, and return whether it was
+// there. A job's command would otherwise have the shell put it in the
+// background and exit at once.
+static bool strip_background(std::string &command)
+{
+    size_t end = command.find_last_not_of(" \t");
+    if (end == std::string::npos || command[end] != '&' ||
+        (end > 0 && (command[end-1] == '&' || command[end-1] == '\\')))
+        return false;
+
+    end = command.find_last_not_of(" \t", end-1);
+    command.erase(end == std::string::npos ? 0 : end+1);
+    return !command.empty();
+}
+
+static void start_job(const std::string &command)
+{
+    const int id = thejobs.start(command);
+
+    char buf[BUFSIZE];
+    if (id)
+        snprintf(buf, BUFSIZE, "[%d] %s", id, command.c_str());
+    else
+        snprintf(buf, BUFSIZE, "Could not start %s", command.c_str());
+    themsg = buf;
+
+    damage();
+    draw();
+    refresh();
+}
+
+template <PROMPT_TYPE prompt>
+static void execute_command(const char *command)
+{
+    TRACE_SCOPE trace("execute_command");
+    // Expand special characters
+    std::string expanded = expand_command(command);
+
+    if (prompt == PROMPT_BACKGROUND)
+    {
+        strip_background(expanded);
+        if (!expanded.empty())
+            start_job(expanded);
+        return;
+    }
+
+    // Any other command ending in & is left to the shell, so that what it
+    // starts can outlive spy. The shell exits straight away, so there's no
+    // pwd to recover.
+    std::string stripped = expanded;
+    const bool detached = strip_background(stripped);
+
+    if (prompt != PROMPT_SILENT)
+    {
+        spy_endwin();
+
+        // Leave the expanded command in the output stream
+        tputs(s_md, 1, putchar);
+        tputs(tgoto(s_cm, 0, thepromptline), 1, putchar);
+        tputs("!", 1, putchar);
+        tputs(expanded.c_str(), 1, putchar);
+        tputs(s_me, 1, putchar);
+        tputs(s_ce, 1, putchar);
+        tputs("\n", 1, putchar);
+
+        thepromptline = LINES-1;
+    }
+    else
+    {
+        // Without leaving curses mode, reset the terminal to shell mode
+        // for the child
+        reset_shell_mode();
+    }
+
+    // Simple commands are executed directly, without the cost of starting a
+    // shell. They can't change the directory, so there's no pwd to recover.
+    std::vector<std::string> args;
+    const bool     direct = split_command(expanded, args);
+
+    // Create a pipe to pass the result of pwd back from the child when
+    // it's done execution. Exclude csh, since the shell syntax for referencing
+    // numbered fds is not available in this shell.
+    const char    *bash = "/bin/bash";
+    const char    *shell = s_shell ? s_shell : bash;
+    bool           recover_cwd = !direct && !detached && !iscsh(shell);
+    int             fd[2];
+
+    if (recover_cwd)
+    {
+        if (pipe(fd) < 0)
+        {
+            perror("pipe failed");
+            recover_cwd = false;
+        }
+    }
+
+    std::vector<char *> argv;
+    if (direct)
+    {
+        for (auto it = args.begin(); it != args.end(); ++it)
+            argv.push_back(&(*it)[0]);
+    }
+    else
+    {
+        if (recover_cwd)
+        {
+            // Append a command to pass the pwd up to the parent
+            char    buf[BUFSIZE];
+            snprintf(buf, BUFSIZE, " && pwd >& %d", fd[1]);
+            expanded += buf;
+        }
+
+        // Execute commands in a subshell
+        argv.push_back(const_cast<char *>(shell));
+        argv.push_back(const_cast<char *>("-c"));
+        argv.push_back(&expanded[0]);
+    }
+    argv.push_back(0);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (recover_cwd)
+        posix_spawn_file_actions_addclose(&actions, fd[0]);
+
+    theevents.unblock();
+
+    // posix_spawn uses vfork semantics, so the cost of launching doesn't
+    // grow with the size of this process. It returns once the child has
+    // called exec, which gives the launch latency.
+    const uint64_t childstart = TRACE::now();
+    pid_t          pid;
+    const int      err = posix_spawnp(&pid, argv[0], &actions, 0,
+                                      &argv[0], environ);
+    TRACE::instance().record(direct ? "spawn.direct" : "spawn.shell",
+                             childstart, TRACE::now());
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err)
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    else
+        thechild = pid;
+
+    // Parent
+    std::string pwd;
+    if (recover_cwd)
+    {
+        close(fd[1]);
+
+        // Wait for the pwd
+        char    buf[BUFSIZE];
+        int        bytes = read(fd[0], buf, BUFSIZE);
+        if (bytes > 1)
+            pwd.assign(buf, bytes-1);
+
+        close(fd[0]);
+    }
+
+    // Reap the child process. A command that couldn't be started exits
+    // with 127, as it would from the shell.
+    int status = W_EXITCODE(127, 0);
+    if (thechild)
+        waitpid(thechild, &status, 0);
+
+    thechild = 0;
+    TRACE::instance().record("child", childstart, TRACE::now());
+
+    theevents.block();
+
+    if (!pwd.empty())
+        spy_chdir(pwd.c_str());
+
+    // If the exit status was non-zero, print some information about what
+    // caused the process to exit.
+    std::string status_string = exit_string(status);
+
+    if (prompt == PROMPT_CONTINUE)
+    {
+        continue_prompt(status_string.c_str());
+    }
+    else
+    {
+        if (prompt == PROMPT_SILENT)
+            spy_endwin();
+
+        if (!status_string.empty())
+            themsg = status_string;
+
+        draw();
+        refresh();
     }
-    return key;
 }
 
-enum RLTYPE {
-    JUMP,
-    SEARCHNEXT,
-    SEARCHPREV,
-    EXECUTE
-};
+// Open the file of the current content search match at the matching line
+static void open_match(const char *program)
+{
+    if (thecurfile >= nfiles())
+        return;
 
-template <RLTYPE TYPE>
-static inline int nextfile(int file) { return file < thefiles.size()-1 ? file+1 : 0; }
+    const DIRINFO &dir = getfile(thecurfile);
 
-template <>
-inline int nextfile<SEARCHPREV>(int file) { return file > 0 ? file-1 : thefiles.size()-1; }
+    // Escape '%' so that it isn't expanded to the current file again
+    std::string path = quote_filename(dir.path());
+    replaceall(path, "%", "\\%");
 
-template <RLTYPE TYPE>
-static void searchnext()
+    char buf[32];
+    snprintf(buf, sizeof(buf), " +%d ", dir.line());
+
+    std::string cmd = program;
+    cmd += buf;
+    cmd += path;
+
+    themsg.clear();
+    execute_command<PROMPT_SILENT>(cmd.c_str());
+}
+
+// Merge any new content search matches into the listing
+static void poll_grep()
 {
-    if (!thesearch)
+    if (!thegrep)
         return;
 
-    // Only search files other than thecurfile
-    int file;
-    for (file = nextfile<TYPE>(thecurfile); file != thecurfile; file = nextfile<TYPE>(file))
+    std::vector<GREP::MATCH> matches;
+    thegrep->take(matches);
+
+    const bool done = thegrep->done();
+    if (matches.empty() && !done)
+        return;
+
+    for (auto it = matches.begin(); it != matches.end(); ++it)
     {
-        if (thefiles[file].match(thesearch.get()))
-            break;
+        thefiles.push_back(DIRINFO());
+        thefiles.back().setmatch(it->path, it->line, it->text);
+        if (!filtered(thefiles.back(), thefilter))
+        {
+            theview.push_back(thefiles.size()-1);
+            thewidths.add(thefiles.back());
+        }
     }
 
-    if (file != thecurfile)
+    if (done)
     {
-        thecurfile = file;
-        filetopage();
+        char buf[BUFSIZE];
+        snprintf(buf, BUFSIZE, "%d matches in %d files%s",
+                (int)thefiles.size(), thegrep->searched(),
+                thegrep->cancelled() ? " (cancelled)" :
+                thegrep->truncated() ? " (too many matches)" : "");
+        themsg = buf;
+
+        thegrep.reset();
+        thestats.reset();
+
+        // Matches arrive in no particular order, so sort them once the
+        // search is complete
+        std::string prevfile;
+        if (thecurfile < nfiles())
+            prevfile = getfile(thecurfile).name();
+
+        std::vector<std::string> tagged;
+        save_tags(tagged);
+
+        std::sort(thefiles.begin(), thefiles.end(),
+                [](const DIRINFO &a, const DIRINFO &b)
+                { return a.match_less(b); });
+        restore_tags(tagged);
+        build_view();
+
+        if (!prevfile.empty())
+            find_and_set_curfile(prevfile);
+    }
+
+    layout(LINES-3, COLS);
+    filetopage();
+
+    if (!isendwin())
+    {
+        draw();
+        refresh();
     }
 }
 
-static char s_termcap_buf[2048];
+template <bool RECURSIVE>
+static void grep()
+{
+    HISTORY_SCOPE scope(s_search_history);
 
-static char *s_mr = 0;
-static char *s_md = 0;
-static char *s_me = 0;
-static char *s_cr = 0;
-static char *s_ce = 0;
-static char *s_cm = 0;
-static char *s_cd = 0;
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<EXECUTE>;
 
-static void init_termcap()
+    // Read input
+    char *pattern = readline(RECURSIVE ? "Grep tree: " : "Grep: ");
+
+    if (!pattern || !*pattern)
+    {
+        cancel_prompt();
+
+        if (pattern)
+            free(pattern);
+
+        return;
+    }
+
+    add_unique_history(pattern);
+
+    // Remember the selection to restore when leaving the results
+    if (thelisting == LISTING_DIRECTORY && thecurfile < nfiles())
+        thesavedcurfile[thecwd] = getfile(thecurfile).name();
+
+    thegrep.reset();
+    thegrep.reset(new GREP(pattern, RECURSIVE));
+    thegreppattern = pattern;
+    thelisting = LISTING_GREP;
+
+    free(pattern);
+
+    thefiles.clear();
+    thetags.clear();
+    thestats.reset();
+    theview.clear();
+    thewidths.clear();
+    thefilter.clear();
+    thequerystr.clear();
+    thequery.clear();
+    thequerymask.clear();
+    thecurfile = 0;
+
+    layout(LINES-3, COLS);
+    filetopage();
+
+    draw();
+    refresh();
+}
+
+// Whether owner or group names shown in the listing have arrived since the
+// last call
+static bool apply_idnames()
 {
-    char *ptr = s_termcap_buf;
+    static int s_generation = 0;
+    if (thedetail != DETAIL_OWNER && thedetail != DETAIL_GROUP)
+        return false;
 
-    s_mr = tgetstr ("mr", &ptr); // Enter reverse mode
-    s_md = tgetstr ("md", &ptr); // Enter bold mode
-    s_me = tgetstr ("me", &ptr); // Exit all formatting modes
-    s_cr = tgetstr ("cr", &ptr); // Move to start of line
-    s_ce = tgetstr ("ce", &ptr); // Clear to end of line
-    s_cm = tgetstr ("cm", &ptr); // Cursor movement
-    s_cd = tgetstr ("cd", &ptr); // Clear to end of screen
+    const int generation = theidnames.generation();
+    if (generation == s_generation)
+        return false;
+    s_generation = generation;
+    return true;
+}
+
+// Repaint the current page once its stat data arrives
+static void poll_stats()
+{
+    if (apply_stats() | apply_idnames())
+    {
+        damage();
+        if (!isendwin())
+        {
+            draw();
+            refresh();
+        }
+    }
+}
+
+// Stop background work
+static void poll_fileop();
+
+static void cancel()
+{
+    if (thegrep)
+    {
+        thegrep->cancel();
+        thegrep->wait();
+        poll_grep();
+    }
+    if (thefileop)
+    {
+        thefileop->cancel();
+        thefileop->wait();
+        poll_fileop();
+    }
 }
 
-static int thepromptline = 0;
-
-template <RLTYPE TYPE>
-static void spy_rl_display()
+// Show the progress of a file operation, and report it once it's done
+static void poll_fileop()
 {
-    int cmdlines = (strlen(rl_prompt) + strlen(rl_line_buffer)) / COLS;
-    int curscol = strlen(rl_prompt) + rl_point;
-    int cursline = curscol / COLS;
+    if (!thefileop)
+        return;
 
-    curscol -= cursline * COLS;
+    if (thefileop->done())
+    {
+        static const char *verbs[] = { "Copied", "Moved", "Deleted" };
+
+        char buf[BUFSIZE];
+        snprintf(buf, BUFSIZE, "%s %d files (%sB)%s", verbs[thefileop->type()],
+                thefileop->files(), perf_count(thefileop->bytes()).c_str(),
+                thefileop->cancelled() ? " (cancelled)" : "");
+        themsg = buf;
+        if (thefileop->errors())
+        {
+            snprintf(buf, BUFSIZE, ", %d errors: ", thefileop->errors());
+            themsg += buf + thefileop->error();
+        }
+
+        thefileop.reset();
+        if (thelisting == LISTING_DIRECTORY)
+            rebuild();
+    }
 
+    damage();
     if (!isendwin())
     {
-        if ((TYPE == SEARCHNEXT || TYPE == SEARCHPREV)
-               && rl_line_buffer && *rl_line_buffer)
-        {
-            // Temporarily replace the current file to show what was found
-            int prevfile = thecurfile;
+        draw();
+        refresh();
+    }
+}
 
-            thesearch.reset(new SPY_REGEX(rl_line_buffer));
-            searchnext<TYPE>();
+// The absolute paths of the selected files
+static bool fileop_sources(std::vector<std::string> &sources)
+{
+    if (thefileop)
+    {
+        themsg = "A file operation is already running";
+        return false;
+    }
 
-            draw(thesearch.get());
+    std::vector<int> files;
+    selected_files(files);
+    for (auto it = files.begin(); it != files.end(); ++it)
+    {
+        const std::string path = thefiles[*it].path();
+        sources.push_back(path[0] == '/' ? path :
+                std::string(thecwd) + "/" + path);
+    }
+    if (sources.empty())
+        themsg = "No files";
 
-            thesearch.reset(0);
+    return !sources.empty();
+}
 
-            thecurfile = prevfile;
-            filetopage();
-        }
+// Copy or move the selected files into a directory, or to a new name if
+// there's only one
+template <FILEOP::TYPE type>
+static void fileop_to(const char *dest)
+{
+    std::vector<std::string> sources;
+    if (fileop_sources(sources))
+    {
+        std::string dir = expand_path(dest);
+        if (dir.empty() || dir[0] != '/')
+            dir = std::string(thecwd) + "/" + dir;
+
+        struct stat st;
+        const bool isdir = !guarded_stat(dir, st) && S_ISDIR(st.st_mode);
+
+        std::vector<std::string> dests;
+        for (auto it = sources.begin(); it != sources.end(); ++it)
+            dests.push_back(isdir ? dir + it->substr(it->rfind('/')) : dir);
+
+        if (!isdir && sources.size() > 1)
+            themsg = dir + ": Not a directory";
         else
-        {
-            draw();
-        }
+            thefileop.reset(new FILEOP(type, sources, dests));
+    }
 
-        attrset(A_NORMAL);
+    draw();
+    refresh();
+}
 
-        // Print the prompt
-        move(LINES-1-cmdlines, 0);
-        addstr(rl_prompt);
-        addstr(rl_line_buffer);
+template <FILEOP::TYPE type>
+static void fileop_prompt()
+{
+    HISTORY_SCOPE scope(s_jump_history);
 
-        // Move to the cursor position
-        move(LINES-1-cmdlines+cursline, curscol);
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<EXECUTE>;
 
-        // Change the cursor color when we're in vi command mode
-        if (rl_editing_mode == 0 && thecommandmode)
-            chgat(1, A_NORMAL, 8, NULL);
+    // Read input
+    char *dest = readline(type == FILEOP::COPY ? "Copy to: " : "Move to: ");
 
-        refresh();
-    }
-    else
+    if (!dest || !*dest)
     {
-        tputs(tgoto(s_cm, 0, thepromptline), 1, putchar);
-        tputs(s_cd, 1, putchar); // Necessary to clear lingering "Continue: "
-        tputs(rl_prompt, 1, putchar);
-        tputs(rl_line_buffer, 1, putchar);
+        cancel_prompt();
 
-        thepromptline = SYSmin(thepromptline, (LINES-1) - cmdlines);
-        cursline += thepromptline;
+        if (dest)
+            free(dest);
 
-        // Move to the cursor position
-        tputs(tgoto(s_cm, curscol, cursline), 1, putchar);
+        return;
     }
+
+    add_unique_history(dest);
+
+    fileop_to<type>(dest);
+
+    free(dest);
 }
 
-static void add_unique_history(const char *command)
+static void delete_files()
 {
-    for (int i = history_length; i-- > 0; )
+    std::vector<std::string> sources;
+    if (fileop_sources(sources))
     {
-        // history_get() uses an offset of history_base
-        const char *line = history_get(history_base+i)->line;
-        if (!strcmp(line, command))
-        {
-            HIST_ENTRY *hist = remove_history(i);
-            free(hist->line);
-            free(hist);
-            break;
-        }
+        themsg = "Delete " + (sources.size() == 1 ?
+                sources[0].substr(sources[0].rfind('/')+1) :
+                std::to_string(sources.size()) + " files") + "? (y/n)";
+        draw();
+        refresh();
+
+        themsg.clear();
+        if (spy_getchar() == 'y')
+            thefileop.reset(new FILEOP(FILEOP::DELETE, sources,
+                        std::vector<std::string>()));
     }
 
-    add_history(command);
+    draw();
+    refresh();
 }
 
-static void continue_prompt(const char *status = 0)
+// Report the background jobs that finished
+static void poll_jobs()
 {
-    tputs(tgoto(s_cm, 0, LINES-1), 1, putchar);
-    tputs(s_mr, 1, putchar);
-    if (status && *status)
+    // Rearm the wakeup for more output
+    thejobs.changed();
+
+    std::vector<JOBS::INFO> done;
+    thejobs.finished(done);
+    if (done.empty())
+        return;
+
+    const JOBS::INFO &job = done.back();
+    const std::string status = exit_string(job.status);
+
+    char buf[BUFSIZE];
+    snprintf(buf, BUFSIZE, "[%d] %s  %s", job.id,
+            status.empty() ? "Done" : status.c_str(), job.command.c_str());
+    themsg = buf;
+
+    damage();
+    if (!isendwin())
     {
-        tputs(status, 1, putchar);
-        tputs(". ", 1, putchar);
+        draw();
+        refresh();
     }
-    tputs("Continue: ", 1, putchar);
-    tputs(s_me, 1, putchar);
-    tputs(s_ce, 1, putchar);
 }
 
-static void cancel_prompt()
+// Pick up a change in the terminal size
+static void check_resize()
 {
-    if (!isendwin())
+    if (isendwin() || !theresized)
+        return;
+
+    theresized = false;
+
+    struct winsize w;
+    ioctl(0, TIOCGWINSZ, &w);
+    resize_term(w.ws_row, w.ws_col);
+
+    layout();
+    damage();
+}
+
+// Split the end of a job's output into at most rows lines for display.
+// Carriage returns (eg. from progress bars) overwrite the line, and other
+// control characters are dropped.
+static void tail_lines(const std::string &output, int rows,
+                       std::vector<std::string> &lines)
+{
+    size_t start = output.length();
+    if (start && output[start-1] == '\n')
+        start--;
+    for (int i = 0; i < rows && start > 0; i++)
     {
-        draw();
-        refresh();
+        size_t nl = output.rfind('\n', start-1);
+        start = nl == std::string::npos ? 0 : nl;
     }
-    else
+    if (start < output.length() && output[start] == '\n')
+        start++;
+
+    std::string line;
+    for (size_t i = start; i < output.length(); i++)
     {
-        continue_prompt();
+        const char c = output[i];
+        if (c == '\n')
+        {
+            lines.push_back(line);
+            line.clear();
+        }
+        else if (c == '\r')
+        {
+            if (i+1 < output.length() && output[i+1] != '\n')
+                line.clear();
+        }
+        else if (c == '\t')
+            line.append(8 - line.length() % 8, ' ');
+        else if ((unsigned char)c >= ' ')
+            line += c;
     }
+    if (!line.empty())
+        lines.push_back(line);
 }
 
-// Class to set and restore history state within a scope
-class HISTORY_SCOPE {
-public:
-    HISTORY_SCOPE(HISTORY_STATE &state) : mystate(state)
+// Draw the job list, with the end of the current job's output below it
+static void drawjobs(const std::vector<JOBS::INFO> &jobs, int current)
+{
+    erase();
+    attrset(A_NORMAL);
+
+    int running, failed;
+    thejobs.counts(running, failed);
+    mvprintw(0, 0, "Jobs: %d running, %d failed", running, failed);
+
+    if (jobs.empty())
+        mvaddstr(1, 0, "<no jobs>");
+
+    const int njobs = jobs.size();
+    const int listrows = SYSmin(njobs, SYSmax((LINES-3)/3, 1));
+    const int first = SYSmax(0, SYSmin(current - listrows/2, njobs - listrows));
+
+    char buf[BUFSIZE];
+    for (int i = 0; i < listrows; i++)
     {
-        history_set_history_state(&mystate);
+        const JOBS::INFO &job = jobs[first+i];
+        std::string state = job.done ? exit_string(job.status) : "Running";
+        if (state.empty())
+            state = "Done";
+
+        snprintf(buf, BUFSIZE, "[%d] %-24s %s", job.id, state.c_str(),
+                job.command.c_str());
+        attrset(first+i == current ? A_REVERSE : A_NORMAL);
+        mvaddnstr(1+i, 0, buf, COLS);
     }
-    ~HISTORY_SCOPE()
+    attrset(A_NORMAL);
+
+    const int top = 2 + SYSmax(listrows, 1);
+    const int rows = LINES-1 - top;
+    mvhline(top-1, 0, ACS_HLINE, COLS);
+
+    if (current >= 0 && current < njobs && rows > 0)
     {
-        HISTORY_STATE *tmp = history_get_history_state();
-        mystate = *tmp;
-        free(tmp);
+        std::vector<std::string> lines;
+        tail_lines(thejobs.output(jobs[current].id), rows, lines);
+        for (int i = 0; i < (int)lines.size(); i++)
+            mvaddnstr(top+i, 0, lines[i].c_str(), COLS);
     }
 
-private:
-    HISTORY_STATE &mystate;
-};
+    attrset(A_REVERSE);
+    mvaddnstr(LINES-1, 0,
+            "j/k: select  x: kill  X: kill -9  c: clear finished  q: return",
+            COLS-1);
+    attrset(A_NORMAL);
+}
 
-static void jump()
-{
-    HISTORY_SCOPE scope(s_jump_history);
+static void refresh_listing();
 
-    // Configure readline
-    rl_redisplay_function = spy_rl_display<JUMP>;
+// Show the background jobs, following the output of the selected job until
+// a key leaves the view
+static void jobs()
+{
+    std::vector<JOBS::INFO> list;
+    thejobs.list(list);
+    int current = (int)list.size()-1;
 
-    // Try to find a good default jump target in the recent history, that
-    // isn't the cwd.
-    std::string lastjump = "~";
-    for (int i = history_length; i-- > 0; )
+    bool changed = false;
+    bool done = false;
+    while (!done)
     {
-        // history_get() uses an offset of history_base
-        const char *line = history_get(history_base+i)->line;
-        if (strcmp(line, thecwd))
+        thejobs.list(list);
+        current = SYSmax(SYSmin(current, (int)list.size()-1), 0);
+
+        drawjobs(list, current);
+        refresh();
+
+        int c = spy_getchar(theheadless);
+        if (c == ERR)
         {
-            lastjump = line;
-            break;
+            std::vector<int> signals;
+            const int events = theevents.wait(-1, signals);
+            handle_signals(signals);
+            check_resize();
+
+            // Background searches and stats are merged on return
+            thejobs.changed();
+            if (events & EVENTLOOP::CHANGE)
+                changed = true;
+            continue;
+        }
+
+        switch (c)
+        {
+            case 'j':
+            case KEY_DOWN:
+                current++;
+                break;
+            case 'k':
+            case KEY_UP:
+                current = SYSmax(current-1, 0);
+                break;
+            case 'x':
+            case 'X':
+                if (current < (int)list.size())
+                    thejobs.kill(list[current].id, c == 'x' ? SIGTERM : SIGKILL);
+                break;
+            case 'c':
+                thejobs.clear();
+                break;
+            case 'q':
+            case ESC:
+            case '&':
+            case '\n':
+            case KEY_ENTER:
+                done = true;
+                break;
         }
     }
 
-    // Read input
-    std::string prompt = "Jump:  (";
-    prompt += lastjump;
-    prompt += ") ";
-    char *input = readline(prompt.c_str());
+    poll_grep();
+    poll_stats();
+    poll_jobs();
+    poll_fileop();
+    if (changed)
+        refresh_listing();
 
+    damage();
+    draw();
+    refresh();
+}
+
+// Read a line for the viewer, drawn over the file
+static std::string view_prompt(const char *prompt)
+{
+    rl_redisplay_function = spy_rl_display<VIEWER>;
+
+    char *input = readline(prompt);
+    std::string str = input ? input : "";
     if (input)
-    {
-        std::string dir = *input ? input : lastjump;
         free(input);
+    return str;
+}
 
-        // Store the current directory
-        add_unique_history(thecwd);
-
-        spy_jump_dir(dir.c_str());
+// Move the viewer to a position typed at its ':' prompt: a line number,
+// '@' and a byte offset with an optional k, M or G suffix, or a percentage
+// of the file
+static void view_goto(FILEVIEW &view, const std::string &str)
+{
+    char *end = 0;
+    const char *start = str.c_str() + (str[0] == '@');
+    uint64_t n = strtoull(start, &end, 10);
+    if (end == start)
+    {
+        view.mymsg = "Expected a line, @offset or N%";
+        return;
+    }
 
-        draw();
-        refresh();
+    if (str[0] == '@')
+    {
+        switch (*end)
+        {
+            case 'G': case 'g': n <<= 10;
+            case 'M': case 'm': n <<= 10;
+            case 'k': case 'K': n <<= 10;
+        }
+        view.mytop = view.line_start(std::min(n, view.size()));
+    }
+    else if (*end == '%')
+    {
+        view.mytop = view.line_start(
+                std::min(view.size() / 100 * n, view.size()));
     }
     else
     {
-        cancel_prompt();
+        uint64_t off;
+        if (view.line_offset(n ? n-1 : 0, off))
+            view.mytop = off;
+        else
+            view.mymsg = "Interrupted";
     }
 }
 
-template <RLTYPE TYPE>
-static void search()
+// Show a file in the built-in viewer, starting at a line (counting from 1)
+static void view_file(const std::string &path, int line)
 {
-    HISTORY_SCOPE scope(s_search_history);
-
-    if (thesearch)
+    FILEVIEW view;
+    if (!view.open(path))
     {
-        thesearch.reset(0);
+        themsg = path + ": " + view.error();
+        draw();
+        refresh();
+        return;
     }
 
-    // Configure readline
-    rl_redisplay_function = spy_rl_display<TYPE>;
+    theviewer = &view;
+    if (line > 1)
+        view.line_offset(line-1, view.mytop);
+
+    std::unique_ptr<SPY_REGEX> search;
+    std::string pattern;
+    bool forward = true;
+
+    bool changed = false;
+    bool done = false;
+    while (!done)
+    {
+        const int rows = SYSmax(LINES-1, 1);
+        if (view.myfollow)
+        {
+            view.reload();
+            view.mytop = view.last_page(rows);
+        }
+
+        view.draw(search.get());
+        refresh();
+        view.mymsg.clear();
+
+        int c = spy_getchar(theheadless);
+        if (c == ERR)
+        {
+            std::vector<int> signals;
+            const int events = theevents.wait(-1, signals);
+            handle_signals(signals);
+            check_resize();
+
+            // Background work is merged on return
+            thejobs.changed();
+            if (events & EVENTLOOP::CHANGE)
+            {
+                view.reload();
+                changed = true;
+            }
+            continue;
+        }
+
+        if (c != 'F')
+            view.myfollow = false;
+
+        // Moving through the file reads it, so check whether it has been
+        // truncated since the draw
+        view.reload();
+        const uint64_t lastpage = view.last_page(rows);
+        switch (c)
+        {
+            case 'j':
+            case KEY_DOWN:
+            case '\n':
+            case KEY_ENTER:
+                if (view.mytop < lastpage)
+                    view.mytop = view.next_line(view.mytop);
+                break;
+            case 'k':
+            case KEY_UP:
+                view.mytop = view.prev_line(view.mytop);
+                break;
+            case ' ':
+            case 'f':
+            case 'F' & 0x1f:
+            case KEY_NPAGE:
+                for (int i = 0; i < rows-1 && view.mytop < lastpage; i++)
+                    view.mytop = view.next_line(view.mytop);
+                break;
+            case 'b':
+            case 'B' & 0x1f:
+            case KEY_PPAGE:
+                for (int i = 0; i < rows-1; i++)
+                    view.mytop = view.prev_line(view.mytop);
+                break;
+            case 'g':
+            case KEY_HOME:
+                view.mytop = 0;
+                break;
+            case 'G':
+            case KEY_END:
+                view.mytop = lastpage;
+                break;
+            case 'h':
+            case KEY_LEFT:
+                view.mycol -= std::min(view.mycol, (uint64_t)COLS/2);
+                break;
+            case 'l':
+            case KEY_RIGHT:
+                view.mycol += COLS/2;
+                break;
+            case '/':
+            case '?':
+            {
+                HISTORY_SCOPE scope(s_search_history);
+                const char prompt[] = {(char)c, '\0'};
+                std::string input = view_prompt(prompt);
+                if (input.empty())
+                    break;
 
-    // Read input
-    char *search = readline("/");
+                add_unique_history(input.c_str());
+                pattern = input;
+                search.reset(new SPY_REGEX(pattern.c_str()));
+                forward = c == '/';
+            }
+            // Fall through to search from the top line
+            case 'n':
+            case 'N':
+                if (search)
+                {
+                    TRACE_SCOPE trace("viewer.search");
+                    bool interrupted;
+                    uint64_t off = view.mytop;
+                    if (view.find(pattern, *search, forward == (c != 'N'),
+                                off, interrupted))
+                        view.mytop = off;
+                    else if (view.mymsg.empty())
+                        view.mymsg = interrupted ? "Interrupted" :
+                            "Pattern not found";
+                }
+                break;
+            case ':':
+            {
+                std::string input = view_prompt("Go to: ");
+                if (!input.empty())
+                    view_goto(view, input);
+                break;
+            }
+            case 'F':
+                view.myfollow = !view.myfollow;
+                if (view.myfollow)
+                    theevents.watchfile(view.path().c_str());
+                else
+                    theevents.unwatchfile();
+                break;
+            case 'q':
+            case ESC:
+                done = true;
+                break;
+        }
 
-    if (search)
-    {
-        if (*search)
+        if (view.truncated())
         {
-            add_unique_history(search);
-
-            thesearch.reset(new SPY_REGEX(search));
+            view.reload();
+            view.mymsg = "File truncated";
         }
+    }
 
-        free(search);
+    theevents.unwatchfile();
+    theviewer = 0;
 
-        searchnext<TYPE>();
+    poll_grep();
+    poll_stats();
+    poll_jobs();
+    poll_fileop();
+    if (changed)
+        refresh_listing();
 
-        draw();
-        refresh();
-    }
-    else
-    {
-        cancel_prompt();
-    }
+    damage();
+    draw();
+    refresh();
 }
 
-static bool needs_quotes(const std::string &str)
+// View the current file (at the matching line of a content search)
+static void view()
 {
-    for (auto it = str.begin(); it != str.end(); ++it)
+    if (thecurfile >= nfiles())
+        return;
+
+    prefetch_opened();
+
+    const DIRINFO &dir = getfile(thecurfile);
+    if (thelisting == LISTING_GREP)
     {
-        char c = *it;
-        if (!isalpha(c) && !isdigit(c) && c != '_' && c != '.' && c != '-')
-            return true;
+        view_file(dir.path(), dir.line());
+        return;
     }
 
-    return false;
+    const std::string name = dir.name();
+    if (!spy_chdir(name.c_str()))
+    {
+        themsg.clear();
+        view_file(name, 0);
+    }
 }
 
-// Expand special command characters
-static std::string expand_command(const char *command)
+// Tag (or with a leading '!', untag) the files in the view whose names
+// match a glob pattern
+static void tag_pattern(const char *pattern)
 {
-    std::string expanded = command;
+    const bool on = *pattern != '!';
+    if (!on)
+        pattern++;
 
-    if (thecurfile < thefiles.size())
+    for (int file = 0; file < nfiles(); file++)
     {
-        std::string filename = thefiles[thecurfile].name();
-        if (needs_quotes(filename))
-        {
-            // Use strong quoting (''). This means that if there's a ' in the
-            // string, we have to close and then re-open the quote.
-            replaceall(filename, "'", "'\\''");
-            filename = std::string("'") + filename + "'";
-        }
-        replaceall_non_escaped(expanded, '%', filename);
+        if (!fnmatch(pattern, getfile(file).path().c_str(), FNM_PERIOD))
+            thetags.set(theview[file], on);
     }
+    damage();
+    tag_message();
 
-    return expanded;
+    draw();
+    refresh();
 }
 
-static const char *signalname(int signal)
+static void tagpattern()
 {
-    switch (signal)
+    HISTORY_SCOPE scope(s_search_history);
+
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<EXECUTE>;
+
+    // Read input
+    char *pattern = readline("Tag: ");
+
+    if (!pattern || !*pattern)
     {
-        case SIGHUP:    return "SIGHUP";
-        case SIGINT:    return "SIGINT";
-        case SIGQUIT:    return "SIGQUIT";
-        case SIGILL:    return "SIGILL";
-        case SIGTRAP:    return "SIGTRAP";
-        case SIGABRT:    return "SIGABRT";
-        case SIGBUS:    return "SIGBUS";
-        case SIGFPE:    return "SIGFPE";
-        case SIGKILL:    return "SIGKILL";
-        case SIGUSR1:    return "SIGUSR1";
-        case SIGSEGV:    return "SIGSEGV";
-        case SIGUSR2:    return "SIGUSR2";
-        case SIGPIPE:    return "SIGPIPE";
-        case SIGALRM:    return "SIGALRM";
-        case SIGTERM:    return "SIGTERM";
-        case SIGSTKFLT:    return "SIGSTKFLT";
-        case SIGCHLD:    return "SIGCHLD";
-        case SIGCONT:    return "SIGCONT";
-        case SIGSTOP:    return "SIGSTOP";
-        case SIGTSTP:    return "SIGTSTP";
-        case SIGTTIN:    return "SIGTTIN";
-        case SIGTTOU:    return "SIGTTOU";
-        case SIGURG:    return "SIGURG";
-        case SIGXCPU:    return "SIGXCPU";
-        case SIGXFSZ:    return "SIGXFSZ";
-        case SIGVTALRM:    return "SIGVTALRM";
-        case SIGPROF:    return "SIGPROF";
-        case SIGWINCH:    return "SIGWINCH";
-        case SIGIO:        return "SIGIO";
-        case SIGPWR:    return "SIGPWR";
-        case SIGSYS:    return "SIGSYS";
-        case SIGSTKSZ:    return "SIGSTKSZ";
-        default:        return strsignal(signal);
+        cancel_prompt();
+
+        if (pattern)
+            free(pattern);
+
+        return;
     }
-}
 
-// Check if the shell name ends in csh. This will also catch tcsh.
-static bool iscsh(const char *shell)
-{
-    const int     shlen = strlen(shell);
-    return shlen >= 3 && !strncmp(shell+shlen-3, "csh", 3);
-}
+    add_unique_history(pattern);
 
-// Set theresized flag so that when curses is reentered the window size is set
-// correctly
-static void spy_endwin()
-{
-    endwin();
-    theresized = true;
+    tag_pattern(pattern);
+    free(pattern);
 }
 
-template <PROMPT_TYPE prompt>
-static void execute_command(const char *command)
-{
-    // Expand special characters
-    std::string expanded = expand_command(command);
-
-    if (prompt != PROMPT_SILENT)
-    {
-        spy_endwin();
+// The number of commands run at once by batch, or 0 for one per CPU
+static int thebatchjobs = 0;
 
-        // Leave the expanded command in the output stream
-        tputs(s_md, 1, putchar);
-        tputs(tgoto(s_cm, 0, thepromptline), 1, putchar);
-        tputs("!", 1, putchar);
-        tputs(expanded.c_str(), 1, putchar);
-        tputs(s_me, 1, putchar);
-        tputs(s_ce, 1, putchar);
-        tputs("\n", 1, putchar);
+// Run a command template for each tagged file, or the current file if none
+// are tagged. Each '%' in the template is replaced by the file, and without
+// one the file is appended, as for xargs. The output of each command is
+// shown once it finishes, along with the progress and any failures.
+static void batch_command(const char *templ)
+{
+    TRACE_SCOPE trace("batch");
 
-        thepromptline = LINES-1;
-    }
-    else
+    std::vector<int> files;
+    selected_files(files);
+    if (files.empty())
     {
-        // Without leaving curses mode, reset the terminal to shell mode
-        // for the child
-        reset_shell_mode();
+        themsg = "No files";
+        draw();
+        refresh();
+        return;
     }
 
-    // Create a pipe to pass the result of pwd back from the child when
-    // it's done execution. Exclude csh, since the shell syntax for referencing
-    // numbered fds is not available in this shell.
-    const char    *bash = "/bin/bash";
-    const char    *shell = s_shell ? s_shell : bash;
-    const bool     recover_cwd = !iscsh(shell);
-    int             fd[2];
-
-    if (recover_cwd)
+    bool placeholder = false;
+    for (const char *c = templ; *c; c++)
     {
-        if (pipe(fd) < 0)
-        {
-            perror("pipe failed");
-        }
+        if (*c == '%' && (c == templ || c[-1] != '\\'))
+            placeholder = true;
     }
 
-    thechild = fork();
-    if (thechild == -1)
+    std::vector<std::string> commands;
+    std::vector<std::string> paths;
+    for (auto it = files.begin(); it != files.end(); ++it)
     {
-        perror("fork failed");
+        paths.push_back(thefiles[*it].path());
+
+        std::string command = templ;
+        const std::string quoted = quote_filename(paths.back());
+        if (placeholder)
+            replaceall_non_escaped(command, '%', quoted);
+        else
+            command += " " + quoted;
+        commands.push_back(command);
     }
-    else if (thechild == 0)
-    {
-        // Child
-        char         buf[BUFSIZE];
-        const char    *args[256];
-        int             va_args = 0;
 
-        if (recover_cwd)
+    const int nthreads = thebatchjobs > 0 ? thebatchjobs :
+        SYSmax(std::thread::hardware_concurrency(), 1);
+
+    spy_endwin();
+
+    // Leave the template in the output stream, as for a command
+    char buf[BUFSIZE];
+    snprintf(buf, BUFSIZE, "!%s  (%d files, %d at a time)", templ,
+            (int)commands.size(), nthreads);
+    tputs(s_md, 1, putchar);
+    tputs(tgoto(s_cm, 0, thepromptline), 1, putchar);
+    tputs(buf, 1, putchar);
+    tputs(s_me, 1, putchar);
+    tputs(s_ce, 1, putchar);
+    tputs("\n", 1, putchar);
+    thepromptline = LINES-1;
+
+    // The commands are run in the foreground process group, so they get
+    // the SIGINT from the terminal. It's read from theevents here to stop
+    // starting commands.
+    BATCH batch(commands, nthreads);
+    int finished = 0;
+    int failed = 0;
+    bool woken = false;
+    while (!batch.done() || finished < (int)commands.size())
+    {
+        std::vector<BATCH::RESULT> results;
+        batch.take(results, 100);
+
+        std::vector<int> signals;
+        if (theevents.wait(0, signals) & EVENTLOOP::WAKE)
+            woken = true;
+        auto sigint = std::find(signals.begin(), signals.end(), SIGINT);
+        if (sigint != signals.end())
         {
-            // Append a command to pass the pwd up to the parent
-            close(fd[0]);
-            snprintf(buf, BUFSIZE, " && pwd >& %d", fd[1]);
-            expanded += buf;
+            batch.cancel();
+            signals.erase(sigint);
         }
+        handle_signals(signals);
 
-        // Execute commands in a subshell
-        args[va_args++] = shell;
-        args[va_args++] = "-c";
-        args[va_args++] = expanded.c_str();
-        args[va_args++] = 0;
-
-        if (execvp(args[0], (char * const *)args) == -1)
+        // Replace the progress line with the output, then show the progress
+        // again below it
+        tputs("\r", 1, putchar);
+        tputs(s_ce, 1, putchar);
+        for (auto it = results.begin(); it != results.end(); ++it)
         {
-            perror("exec failed");
-            exit(1);
+            fwrite(it->output.data(), 1, it->output.size(), stdout);
+
+            const std::string status = exit_string(it->status);
+            if (!status.empty())
+            {
+                tputs(s_md, 1, putchar);
+                printf("%s: %s", paths[it->index].c_str(), status.c_str());
+                tputs(s_me, 1, putchar);
+                tputs("\n", 1, putchar);
+                failed++;
+            }
+            finished++;
         }
 
-        // Unreachable
+        printf("[%d/%d]", finished, (int)commands.size());
+        if (failed)
+            printf(" %d failed", failed);
+        if (batch.cancelled())
+            printf(" (cancelled)");
+        fflush(stdout);
+
+        if (batch.done() && results.empty())
+            break;
     }
+    tputs("\n", 1, putchar);
 
-    // Parent
-    if (recover_cwd)
-    {
-        close(fd[1]);
+    snprintf(buf, BUFSIZE, "%d of %d commands failed%s", failed,
+            (int)commands.size(), batch.cancelled() ? " (cancelled)" : "");
 
-        // Wait for the pwd
-        char    buf[BUFSIZE];
-        int        bytes = read(fd[0], buf, BUFSIZE);
-        if (bytes > 1)
-        {
-            buf[bytes-1] = '\0';
-            spy_chdir(buf);
-        }
+    // The commands have likely changed the files
+    rebuild();
 
-        close(fd[0]);
-    }
+    // Leave the background work that woke us to the main loop
+    if (woken)
+        theevents.wake();
 
-    // Reap the child process
-    int status;
-    waitpid(thechild, &status, 0);
+    continue_prompt(failed || batch.cancelled() ? buf : 0);
+}
 
-    thechild = 0;
+static void batch()
+{
+    HISTORY_SCOPE scope(s_execute_history);
 
-    // If the exit status was non-zero, print some information about what
-    // caused the process to exit.
-    std::string status_string;
-    if (WIFEXITED(status))
-    {
-        int exit_status = WEXITSTATUS(status);
-        if (exit_status)
-        {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "Exit status %d", exit_status);
-            status_string = buf;
-        }
-    }
-    else if (WIFSIGNALED(status))
-    {
-        if (WCOREDUMP(status))
-        {
-            status_string = "Core dumped";
-        }
-        else
-        {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "Terminated by %s", signalname(WTERMSIG(status)));
-            status_string = buf;
-        }
-    }
+    // Configure readline
+    rl_redisplay_function = spy_rl_display<EXECUTE>;
 
-    if (prompt == PROMPT_CONTINUE)
-    {
-        continue_prompt(status_string.c_str());
-    }
-    else
+    // Read input
+    char *templ = readline("Batch: ");
+
+    if (!templ || !*templ)
     {
-        if (prompt == PROMPT_SILENT)
-            spy_endwin();
+        cancel_prompt();
 
-        if (!status_string.empty())
-            themsg = status_string;
+        if (templ)
+            free(templ);
 
-        draw();
-        refresh();
+        return;
     }
+
+    add_unique_history(templ);
+
+    batch_command(templ);
+
+    free(templ);
 }
 
+template <PROMPT_TYPE prompt>
 static void execute()
 {
     HISTORY_SCOPE scope(s_execute_history);
@@ -1760,7 +8022,7 @@ static void execute()
     rl_redisplay_function = spy_rl_display<EXECUTE>;
 
     // Read input
-    char *command = readline("!");
+    char *command = readline(prompt == PROMPT_BACKGROUND ? "&" : "!");
 
     if (!command || !*command)
     {
@@ -1774,7 +8036,7 @@ static void execute()
 
     add_unique_history(command);
 
-    execute_command<PROMPT_CONTINUE>(command);
+    execute_command<prompt>(command);
 
     free(command);
 }
@@ -1834,6 +8096,8 @@ static void show_command()
 
 static void quit_prep()
 {
+    thejobs.hangup();
+
     if (!isendwin())
     {
         spy_endwin();
@@ -1844,21 +8108,12 @@ static void quit_prep()
         tputs(s_ce, 1, putchar); // Necessary to clear lingering "Continue: "
     }
 
-    // Save jump history
+    // Save the visited directories. The cwd was recorded when it was
+    // entered, so it's already the most recent entry.
+    if (!thefrecency.save(s_frecencyfile))
     {
-        HISTORY_SCOPE scope(s_jump_history);
-
-        // Add the cwd to the history first, since often I'll want to jump
-        // there upon restart
-        if (*thecwd)
-        {
-            add_unique_history(thecwd);
-        }
-        if (write_history(s_jhistoryfile.c_str()))
-        {
-            fprintf(stderr, "warning: Could not write history file %s\n",
-                    s_jhistoryfile.c_str());
-        }
+        fprintf(stderr, "warning: Could not write history file %s\n",
+                s_frecencyfile.c_str());
     }
 
     // Save command history
@@ -1919,10 +8174,7 @@ public:
 
     void operator()() const
     {
-        if (!mystr.empty())
-            mysfn(mystr.c_str());
-        else
-            myvfn();
+        run();
 
         if (mydraw)
         {
@@ -1931,10 +8183,30 @@ public:
         }
     }
 
+    // Run the command without drawing
+    void run() const
+    {
+        if (!mystr.empty())
+            mysfn(mystr.c_str());
+        else
+            myvfn();
+    }
+
+    // Motion commands only move the current file, so a run of them can be
+    // drawn once
+    bool ismotion() const
+    {
+        return myvfn == down || myvfn == up ||
+            myvfn == left || myvfn == right ||
+            myvfn == pagedown || myvfn == pageup ||
+            myvfn == firstfile || myvfn == lastfile;
+    }
+
     const char *name() const { return myname; }
     const char *str() const { return mystr.c_str(); }
 
     bool has_vfn() const { return myvfn; }
+    bool draws() const { return mydraw; }
     bool has_sfn() const { return mysfn; }
 
     void set_str(const std::string &str)
@@ -1964,6 +8236,8 @@ static void help()
     // for the child
     reset_shell_mode();
 
+    theevents.unblock();
+
     FILE *pipe = popen("less", "w");
 
     // Write
@@ -1999,15 +8273,14 @@ static void help()
 
     thechild = 0;
 
+    theevents.block();
+
     spy_endwin();
 }
 
-static void read_spyrc(std::istream &is,
-        const std::map<std::string, CALLBACK> &commands,
-        std::map<int, CALLBACK> &keys)
+// Build a reverse map for all key names
+static void build_keymap(std::map<std::string, int> &keymap)
 {
-    // Build a reverse map for all keys
-    std::map<std::string, int> keymap;
     for (int i = 0; i < KEY_MAX; i++)
     {
         const char *name = keyname(i);
@@ -2018,6 +8291,14 @@ static void read_spyrc(std::istream &is,
     // There's probably another mapping we should use
     keymap["<Enter>"] = '\n';
     keymap["<Space>"] = ' ';
+}
+
+static void read_spyrc(std::istream &is,
+        const std::map<std::string, CALLBACK> &commands,
+        std::map<int, CALLBACK> &keys)
+{
+    std::map<std::string, int> keymap;
+    build_keymap(keymap);
 
     std::map<std::string, int> colormap;
     colormap["black"] = COLOR_BLACK;
@@ -2099,6 +8380,73 @@ static void read_spyrc(std::istream &is,
 
             keys[key] = cb;
         }
+        else if (cmd == "packcolumns")
+        {
+            thepackcolumns = true;
+        }
+        else if (cmd == "internalviewer")
+        {
+            theinternalviewer = true;
+        }
+        else if (cmd == "prefetch")
+        {
+            int mb;
+            if (iss >> mb)
+                theprefetch.setbudget((uint64_t)SYSmax(mb, 0) << 20);
+            else
+                fprintf(stderr, "warning: Missing prefetch budget in MB\n");
+        }
+        else if (cmd == "fstimeout")
+        {
+            int ms;
+            if (iss >> ms)
+                thefsguard.settimeout(SYSmax(ms, 0));
+            else
+                fprintf(stderr, "warning: Missing filesystem timeout in ms\n");
+        }
+        else if (cmd == "fsprofile")
+        {
+            std::string name;
+            if (!(iss >> name))
+            {
+                fprintf(stderr, "warning: Missing filesystem profile\n");
+                continue;
+            }
+
+            FSPROFILE *profile = fsprofile(name);
+            if (!profile)
+            {
+                fprintf(stderr, "warning: Unknown filesystem profile %s\n", name.c_str());
+                continue;
+            }
+
+            std::string setting;
+            while (iss >> setting)
+            {
+                std::string value;
+                if (!(iss >> value))
+                {
+                    fprintf(stderr, "warning: Missing value for %s\n", setting.c_str());
+                    break;
+                }
+
+                if (setting == "threads")
+                    profile->mythreads = SYSmin(SYSmax(atoi(value.c_str()), 1), MAXSTATTHREADS);
+                else if (setting == "stat" && (value == "all" || value == "page"))
+                    profile->mystatall = value == "all";
+                else if (setting == "cache")
+                    profile->mycachettl = SYSmax(atoi(value.c_str()), 0);
+                else if (setting == "prefetch")
+                    profile->myprefetch = SYSmax(atoi(value.c_str()), 0);
+                else
+                    fprintf(stderr, "warning: Unrecognized profile setting %s %s\n", setting.c_str(), value.c_str());
+            }
+        }
+        else if (cmd == "batchjobs")
+        {
+            if (!(iss >> thebatchjobs))
+                fprintf(stderr, "warning: Missing number of batch jobs\n");
+        }
         else if (cmd == "relaxprompt" ||
                 cmd == "relaxsearch" ||
                 cmd == "relaxcase")
@@ -2190,7 +8538,27 @@ static void spy_rl_display_match_list (char **matches, int len, int max)
     if (!isendwin())
         spy_endwin();
 
-    rl_display_match_list(matches, len, max);
+    // Completions include the directory being completed in, so show just
+    // the names like readline does for filenames
+    std::vector<char *> names(matches, matches+len+1);
+    max = 0;
+    for (int i = 1; i <= len; i++)
+    {
+        char *name = names[i];
+        const int namelen = strlen(name);
+        for (int j = namelen-1; j-- > 0; )
+        {
+            if (name[j] == '/')
+            {
+                names[i] = name + j + 1;
+                break;
+            }
+        }
+        max = SYSmax(max, strlen(names[i]));
+    }
+    names.push_back(0);
+
+    rl_display_match_list(&names[0], len, max);
 }
 
 static void spy_rl_prep_terminal(int)
@@ -2203,17 +8571,78 @@ static void spy_rl_deprep_terminal()
 {
 }
 
+// Filename completion from the cached directory listings
+static char *spy_rl_filename_completion(const char *str, int state)
+{
+    static std::vector<std::string> matches;
+    static int next;
+    static bool users;
+
+    // Leave user name completion to readline
+    if (!state)
+        users = str[0] == '~' && !strchr(str, '/');
+    if (users)
+        return rl_username_completion_function(str, state);
+
+    if (!state)
+    {
+        matches.clear();
+        next = 0;
+
+        std::string text = str;
+        const size_t slash = text.rfind('/');
+
+        std::string dirpart = slash == std::string::npos ? "" :
+            text.substr(0, slash+1);
+        std::string prefix = text.substr(dirpart.length());
+
+        // Find the absolute path of the directory
+        std::string dir = dirpart;
+        if (dir[0] == '~')
+        {
+            size_t userlen = dir.find('/');
+            std::string user = dir.substr(1, userlen-1);
+            const struct passwd *pw = user.empty() ? 0 : getpwnam(user.c_str());
+            const char *home = user.empty() ? s_home : pw ? pw->pw_dir : 0;
+            if (home)
+                dir = home + dir.substr(userlen);
+        }
+        if (dir[0] != '/')
+            dir = std::string(thecwd) + "/" + dir;
+        while (dir.length() > 1 && dir[dir.length()-1] == '/')
+            dir.erase(dir.length()-1);
+
+        if (dir == thecwd)
+            cache_listing();
+
+        const std::vector<std::string> &names = thelistings.get(dir);
+        for (auto it = std::lower_bound(names.begin(), names.end(), prefix);
+                it != names.end() && !it->compare(0, prefix.length(), prefix);
+                ++it)
+        {
+            matches.push_back(dirpart + *it);
+        }
+
+        // Don't add a space after a directory, to continue completing in it
+        if (matches.size() == 1 &&
+                matches[0][matches[0].length()-1] == '/')
+            rl_completion_suppress_append = 1;
+    }
+
+    return next < matches.size() ? strdup(matches[next++].c_str()) : 0;
+}
+
 static char *spy_rl_completion_matches(const char *str, int state)
 {
     // Handle completion through '%'
-    if (thecurfile < thefiles.size())
+    if (thecurfile < nfiles())
     {
         std::string expanded = str;
-        const std::string &filename = thefiles[thecurfile].name();
+        const std::string filename = getfile(thecurfile).path();
         replaceall_non_escaped(expanded, '%', filename);
         if (expanded != str)
         {
-            char *rval = rl_filename_completion_function(expanded.c_str(), state);
+            char *rval = spy_rl_filename_completion(expanded.c_str(), state);
             if (rval)
             {
                 expanded = rval;
@@ -2226,7 +8655,7 @@ static char *spy_rl_completion_matches(const char *str, int state)
         }
     }
 
-    return rl_filename_completion_function(str, state);
+    return spy_rl_filename_completion(str, state);
 }
 
 static void init_curses()
@@ -2240,8 +8669,23 @@ static void init_curses()
 
     // Using newterm() instead of initscr() is supposed to avoid stdout
     // buffering problems with child processes
-    SCREEN *screen = newterm(NULL, fopen("/dev/tty", "w"), fopen("/dev/tty", "r"));
-    assert(screen);
+    // Headless mode draws to an in-memory screen of a fixed terminal type,
+    // so that its output doesn't depend on the environment. The size can be
+    // set with $LINES and $COLUMNS.
+    if (theheadless)
+    {
+        SCREEN *screen = newterm((char *)"xterm",
+                fopen("/dev/null", "w"), fopen("/dev/null", "r"));
+        assert(screen);
+    }
+    else
+    {
+        FILE *in = fopen("/dev/tty", "re");
+        SCREEN *screen = newterm(NULL, fopen("/dev/tty", "we"), in);
+        assert(screen);
+
+        theevents.settty(fileno(in));
+    }
 
     // This is required for the arrow and backspace keys to function
     // correctly
@@ -2255,11 +8699,9 @@ static void init_curses()
     // which produces flicker.
     //scrollok(stdscr, true);
 
-    // Block for 1s in getch(). ERR is returned on timout, so we can handle
-    // resize events.
-    // NOTE: Even with a 1s timeout, curses seems to give us ERR keys
-    // faster than that while the window is being resized.
-    timeout(1000);
+    // Don't block in getch(). Waiting for input is done by spy_getchar()
+    // and the main loop, which also watch for signals and background work.
+    timeout(0);
 
     set_escdelay(0);
 
@@ -2287,9 +8729,27 @@ static void load_history(const std::string &fname, HISTORY_STATE &state)
     read_history(fname.c_str());
 }
 
+static void load_jumps()
+{
+    // The visited directories were originally saved as a readline history
+    if (!thefrecency.load(s_frecencyfile))
+        thefrecency.import(s_jhistoryfile, time(0));
+
+    // Seed the Jump prompt history with the most recent directories
+    const size_t maxhistory = 1000;
+
+    HISTORY_SCOPE scope(s_jump_history);
+    std::vector<std::string> paths;
+    thefrecency.recent(paths);
+    const size_t first =
+        paths.size() > maxhistory ? paths.size() - maxhistory : 0;
+    for (size_t i = first; i < paths.size(); i++)
+        add_history(paths[i].c_str());
+}
+
 static void init_readline()
 {
-    load_history(s_jhistoryfile, s_jump_history);
+    load_jumps();
     load_history(s_chistoryfile, s_execute_history);
 
     rl_getc_function = spy_rl_getc;
@@ -2326,10 +8786,17 @@ static CALLBACK thecallbacks[] = {
     CALLBACK("jump", jump, jump_dir, false),
 
     CALLBACK("search", search<SEARCHNEXT>, 0, false),
+    CALLBACK("filter", filterfiles, 0, false),
+    CALLBACK("query", query, 0, false),
     CALLBACK("next", searchnext<SEARCHNEXT>),
     CALLBACK("prev", searchnext<SEARCHPREV>),
 
-    CALLBACK("unix_cmd", execute, 0, false),
+    CALLBACK("grep", grep<false>, 0, false),
+    CALLBACK("rgrep", grep<true>, 0, false),
+    CALLBACK("cancel", cancel),
+
+    CALLBACK("unix_cmd", execute<PROMPT_CONTINUE>, 0, false),
+    CALLBACK("unix_cmd_background", execute<PROMPT_BACKGROUND>, 0, false),
 
     CALLBACK("unix", 0, execute_command<PROMPT_CONTINUE>, false),
     CALLBACK("unix_silent", 0, execute_command<PROMPT_SILENT>, false),
@@ -2337,11 +8804,21 @@ static CALLBACK thecallbacks[] = {
     CALLBACK("prompt", 0, prompt_command<PROMPT_CONTINUE>, false),
     CALLBACK("prompt_silent", 0, prompt_command<PROMPT_SILENT>, false),
     CALLBACK("prompt_interactive", 0, prompt_command<PROMPT_INTERACTIVE>, false),
+    CALLBACK("unix_background", 0, execute_command<PROMPT_BACKGROUND>, false),
+    CALLBACK("prompt_background", 0, prompt_command<PROMPT_BACKGROUND>, false),
+
+    CALLBACK("jobs", jobs, 0, false),
+    CALLBACK("view", view, 0, false),
+    CALLBACK("batch", batch, batch_command, false),
+
+    CALLBACK("copy", fileop_prompt<FILEOP::COPY>, fileop_to<FILEOP::COPY>, false),
+    CALLBACK("move", fileop_prompt<FILEOP::MOVE>, fileop_to<FILEOP::MOVE>, false),
+    CALLBACK("delete", delete_files, 0, false),
 
     CALLBACK("last_cmd", last_command, 0, false),
     CALLBACK("show_cmd", show_command, 0, false),
 
-    CALLBACK("redraw", rebuild),
+    CALLBACK("redraw", redraw),
 
     CALLBACK("loadrc", reload),
 
@@ -2349,14 +8826,330 @@ static CALLBACK thecallbacks[] = {
     CALLBACK("detailtoggle", detailtoggle),
 
     CALLBACK("debugmode", debugmode),
+    CALLBACK("tracedump", tracedump),
 
     CALLBACK("take", take),
+    CALLBACK("tagall", tagall),
+    CALLBACK("tagpattern", tagpattern, tag_pattern, false),
+    CALLBACK("untag", untag),
     CALLBACK("setenv", setenv),
     CALLBACK("ignore", ignore),
 
     CALLBACK("help", help),
 };
 
+static void handle_key(int c)
+{
+    auto it = thekeys.find(c);
+    if (it != thekeys.end())
+    {
+        if (isendwin())
+        {
+            // Clear the continue prompt
+            tputs(s_cr, 1, putchar);
+            tputs(s_ce, 1, putchar);
+        }
+
+        themsg.clear();
+
+        TRACE_SCOPE trace(it->second.name());
+        it->second();
+    }
+    else if (!isendwin())
+    {
+        char buf[BUFSIZE];
+        snprintf(buf, BUFSIZE, "Key '%s' [%d] undefined", keyname(c), c);
+
+        themsg = buf;
+        draw();
+        refresh();
+    }
+}
+
+// Changes to the current directory are picked up after a short delay, so
+// that a burst of changes only rebuilds the listing once
+static const int REFRESHDELAY = 100;
+static bool therefreshpending = false;
+static std::chrono::steady_clock::time_point therefreshtime;
+
+static void refresh_listing()
+{
+    therefreshpending = false;
+
+    // Search results are left alone, and a command that left curses will
+    // refresh when it returns
+    if (thelisting != LISTING_DIRECTORY || isendwin())
+        return;
+
+    rebuild();
+    draw();
+    refresh();
+}
+
+// Read a key script. Each line is one of:
+//   key NAME...   keys, named as in .spyrc
+//   text STRING   the characters of STRING, eg. for a prompt
+//   wait          wait for background work (searches, stats) to finish
+static bool read_script(const char *fname)
+{
+    std::ifstream is(fname);
+    if (!is)
+    {
+        fprintf(stderr, "error: Could not read key script %s\n", fname);
+        return false;
+    }
+
+    std::map<std::string, int> keymap;
+    build_keymap(keymap);
+
+    std::string line;
+    while (std::getline(is, line))
+    {
+        std::istringstream iss(line);
+
+        std::string cmd;
+        if (!(iss >> cmd) || cmd[0] == '#')
+            continue;
+
+        if (cmd == "key")
+        {
+            std::string name;
+            while (iss >> name)
+            {
+                auto key_it = keymap.find(name);
+                if (key_it == keymap.end())
+                {
+                    fprintf(stderr, "error: Unrecognized key %s\n", name.c_str());
+                    return false;
+                }
+                thescriptkeys.push_back(key_it->second);
+            }
+        }
+        else if (cmd == "text")
+        {
+            std::string text;
+            iss.get();
+            std::getline(iss, text);
+            thescriptkeys.insert(thescriptkeys.end(), text.begin(), text.end());
+        }
+        else if (cmd == "wait")
+        {
+            thescriptkeys.push_back(SCRIPT_WAIT);
+        }
+        else
+        {
+            fprintf(stderr, "error: Unrecognized script command %s\n", cmd.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Wait for the background work to finish and merge its results
+static void wait_background()
+{
+    if (thegrep)
+    {
+        thegrep->wait();
+        poll_grep();
+    }
+    if (thefileop)
+    {
+        thefileop->wait();
+        poll_fileop();
+    }
+    while (thestats.busy() || theidnames.busy())
+    {
+        usleep(1000);
+        poll_stats();
+    }
+}
+
+// Replay the key script, then print the time taken by each key's command
+// and the final screen contents to stdout
+static void run_headless()
+{
+    struct LATENCY {
+        int key;
+        const char *command;
+        double ms;
+    };
+    std::vector<LATENCY> latencies;
+
+    while (!thescriptkeys.empty())
+    {
+        const int c = thescriptkeys.front();
+        thescriptkeys.pop_front();
+
+        if (c == SCRIPT_WAIT)
+        {
+            wait_background();
+            continue;
+        }
+
+        auto it = thekeys.find(c);
+
+        TIMER timer(false);
+        handle_key(c);
+
+        LATENCY latency;
+        latency.key = c;
+        latency.command = it != thekeys.end() ? it->second.name() : "";
+        latency.ms = timer.elapsed() * 1000;
+        latencies.push_back(latency);
+    }
+
+    wait_background();
+
+    std::vector<std::string> screen;
+    for (int y = 0; y < LINES; y++)
+    {
+        char buf[BUFSIZE];
+        int len = mvinnstr(y, 0, buf, SYSmin(COLS, BUFSIZE-1));
+        std::string row(buf, SYSmax(len, 0));
+        row.erase(row.find_last_not_of(' ') + 1);
+        screen.push_back(row);
+    }
+
+    endwin();
+
+    for (auto it = latencies.begin(); it != latencies.end(); ++it)
+        printf("%s\t%s\t%.3f\n", keyname(it->key), it->command, it->ms);
+    printf("\n");
+    for (auto it = screen.begin(); it != screen.end(); ++it)
+        printf("%s\n", it->c_str());
+
+    exit(0);
+}
+
+// Benchmarks over a tree made by gentree. Each result is printed as a line
+// of "name<TAB>operations<TAB>nanoseconds per operation".
+static void bench_report(const std::string &name, int n, double seconds)
+{
+    printf("%s\t%d\t%.1f\n", name.c_str(), n, n ? seconds * 1e9 / n : 0.0);
+    fflush(stdout);
+}
+
+// Results of the timed loops are added here, so that the compiler can't
+// drop the loops as unused
+static volatile uint64_t s_benchsink = 0;
+
+static void bench_listing(const std::string &root, const char *label)
+{
+    const std::string dir = root + "/" + label;
+    if (chdir(dir.c_str()))
+        return;
+
+    const std::string prefix = std::string(label) + ".";
+    TIMER timer(false);
+
+    // Enumeration alone, then a full rebuild (enumerate, sort and layout)
+    int n = 0;
+    DIR *dp = opendir(".");
+    if (!dp)
+        return;
+    while (readdir(dp))
+        n++;
+    closedir(dp);
+    bench_report(prefix + "readdir", n, timer.lap());
+
+    rebuild();
+    bench_report(prefix + "rebuild", thefiles.size(), timer.lap());
+
+    // Fresh entries, so that nothing is cached from the rebuild
+    std::vector<DIRINFO> dirs(thefiles.size());
+    for (int i = 0; i < thefiles.size(); i++)
+    {
+        dirs[i].setname(thefiles[i].name().c_str());
+        if (thefiles[i].isdirectory())
+            dirs[i].setdirectory();
+    }
+    std::mt19937 random(1);
+    std::shuffle(dirs.begin(), dirs.end(), random);
+
+    timer.lap();
+    parallel_stat(dirs);
+    bench_report(prefix + "stat", dirs.size(), timer.lap());
+
+    int compares = 0;
+    std::sort(dirs.begin(), dirs.end(),
+            [&compares](const DIRINFO &a, const DIRINFO &b)
+            { compares++; return a < b; });
+    bench_report(prefix + "compare", compares, timer.lap());
+
+    int count = 0;
+    for (auto it = dirs.begin(); it != dirs.end(); ++it)
+        count += ignored(it->name().c_str());
+    s_benchsink += count;
+    bench_report(prefix + "ignored", dirs.size(), timer.lap());
+
+    chtype attrs = 0;
+    for (auto it = dirs.begin(); it != dirs.end(); ++it)
+        attrs |= file_attr(*it, false);
+    s_benchsink += attrs;
+    bench_report(prefix + "file_attr", dirs.size(), timer.lap());
+
+    ROWCACHE row;
+    for (auto it = dirs.begin(); it != dirs.end(); ++it)
+        compose_row(*it, false, row);
+    bench_report(prefix + "compose_row", dirs.size(), timer.lap());
+
+    SPY_REGEX regex("e[0-9]*7\\.");
+    int hlstart, hlend;
+    count = 0;
+    for (auto it = dirs.begin(); it != dirs.end(); ++it)
+        count += regex.search(it->name().c_str(), hlstart, hlend);
+    s_benchsink += count;
+    bench_report(prefix + "regex", dirs.size(), timer.lap());
+}
+
+static void bench_deep(const std::string &root)
+{
+    if (chdir((root + "/deep").c_str()))
+        return;
+
+    TIMER timer(false);
+    int levels = 0;
+    do
+    {
+        rebuild();
+        levels++;
+    } while (!chdir("d"));
+    bench_report("deep.descend", levels, timer.lap());
+}
+
+static void bench_spawn(const std::string &root)
+{
+    if (chdir(root.c_str()))
+        return;
+
+    // A simple command is executed directly, and a compound one by the shell
+    const int n = 20;
+    TIMER timer(false);
+    for (int i = 0; i < n; i++)
+        execute_command<PROMPT_SILENT>("true");
+    bench_report("spawn.direct", n, timer.lap());
+
+    for (int i = 0; i < n; i++)
+        execute_command<PROMPT_SILENT>("true || true");
+    bench_report("spawn.shell", n, timer.lap());
+}
+
+// Run the benchmarks on the headless screen, so that no tty is needed
+static void run_bench(const char *dir)
+{
+    std::string root = dir;
+
+    bench_listing(root, "flat");
+    bench_listing(root, "names");
+    bench_listing(root, "links");
+    bench_deep(root);
+    bench_spawn(root);
+
+    endwin();
+    exit(0);
+}
+
 int main(int argc, char *argv[])
 {
     // Retain the initial arguments for reload()
@@ -2366,6 +9159,24 @@ int main(int argc, char *argv[])
     signal(SIGTERM, signal_handler);
     signal(SIGWINCH, signal_resize);
 
+    // spy -headless SCRIPT, or spy -bench DIR
+    const char *script = 0;
+    const char *bench = 0;
+    if (argc == 3 && !strcmp(argv[1], "-headless"))
+    {
+        theheadless = true;
+        script = argv[2];
+        if (!read_script(script))
+            return 1;
+    }
+    else if (argc == 3 && !strcmp(argv[1], "-bench"))
+    {
+        theheadless = true;
+        bench = argv[2];
+    }
+    else
+        theevents.init();
+
     for (int i = 0; i < sizeof(thecallbacks)/sizeof(CALLBACK); i++)
     {
         thecommands[thecallbacks[i].name()] = thecallbacks[i];
@@ -2373,7 +9184,8 @@ int main(int argc, char *argv[])
 
     // Install default keybindings
     {
-        std::stringstream is((const char *)spyrc_defaults);
+        std::stringstream is(std::string((const char *)spyrc_defaults,
+                    spyrc_defaults_len));
         if (is)
             read_spyrc(is, thecommands, thekeys);
     }
@@ -2397,54 +9209,124 @@ int main(int argc, char *argv[])
     init_termcap();
     init_curses();
 
+    if (bench)
+        run_bench(bench);
+
     rebuild();
     draw();
     refresh();
 
+    thefrecency.visit(thecwd, time(0));
+
     thepromptline = LINES-1;
 
+    if (theheadless)
+        run_headless();
+
     while (true)
     {
-        int c = spy_getchar();
+        // Sleep until there's input, a signal, background work to merge or
+        // a pending refresh
+        int ms = -1;
+        if (therefreshpending)
+        {
+            ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    therefreshtime - std::chrono::steady_clock::now()).count();
+            ms = SYSmax(ms, 0);
+        }
 
-        if (!isendwin() && theresized)
+        int events = EVENTLOOP::INPUT;
+        if (!isendwin() && thepushedkey == ERR)
         {
-            theresized = false;
+            std::vector<int> signals;
+            events = theevents.wait(ms, signals);
+            handle_signals(signals);
+        }
+
+        if (events & EVENTLOOP::WAKE)
+        {
+            poll_grep();
+            poll_stats();
+            poll_jobs();
+            poll_fileop();
+        }
 
-            struct winsize w;
-            ioctl(0, TIOCGWINSZ, &w);
-            resize_term(w.ws_row, w.ws_col);
+        // A directory that keeps changing is still refreshed once the delay
+        // from its first change has passed
+        if ((events & EVENTLOOP::CHANGE) && !therefreshpending)
+        {
+            therefreshpending = true;
+            therefreshtime = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(REFRESHDELAY);
+        }
+        else if (therefreshpending &&
+                std::chrono::steady_clock::now() >= therefreshtime)
+        {
+            refresh_listing();
+        }
 
-            layout();
+        if (!isendwin() && theresized)
+        {
+            check_resize();
             draw();
             refresh();
         }
 
-        if (c == ERR)
+        if (!(events & EVENTLOOP::INPUT))
             continue;
 
-        auto it = thekeys.find(c);
-        if (it != thekeys.end())
+        // Handle all the keys that are waiting. A run of motion commands is
+        // drawn once, after the last of them, so that the cursor doesn't
+        // lag behind key repeat. Once a command leaves curses, the continue
+        // prompt blocks for the next key.
+        int c;
+        std::vector<uint64_t> moved;
+        while ((c = spy_getchar(isendwin())) != ERR)
         {
-            if (isendwin())
+            const uint64_t keytime = TRACE::now();
+
+            auto it = thekeys.find(c);
+            if (!isendwin() && it != thekeys.end() && it->second.ismotion())
+            {
+                if (!moved.empty())
+                    themergedkeys++;
+                moved.push_back(keytime);
+
+                themsg.clear();
+
+                TRACE_SCOPE trace(it->second.name());
+                it->second.run();
+                continue;
+            }
+
+            if (!moved.empty())
             {
-                // Clear the continue prompt
-                tputs(s_cr, 1, putchar);
-                tputs(s_ce, 1, putchar);
+                draw();
+                refresh();
+                for (auto it = moved.begin(); it != moved.end(); ++it)
+                    record_latency(*it);
+                moved.clear();
             }
 
-            themsg.clear();
-            it->second();
+            handle_key(c);
+            if (isendwin())
+                break;
+
+            // Prompts wait for more input, so only commands that draw
+            // straight away have a meaningful latency
+            if (it == thekeys.end() || it->second.draws())
+                record_latency(keytime);
         }
-        else if (!isendwin())
-        {
-            char buf[BUFSIZE];
-            snprintf(buf, BUFSIZE, "Key '%s' [%d] undefined", keyname(c), c);
 
-            themsg = buf;
+        if (!moved.empty())
+        {
             draw();
             refresh();
+            for (auto it = moved.begin(); it != moved.end(); ++it)
+                record_latency(*it);
         }
+
+        prefetch_current();
     }
 
     quit();
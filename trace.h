@@ -0,0 +1,100 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+
+// Spans of time recorded into a ring buffer, which keeps the most recent
+// SIZE spans. Recording is cheap enough to leave on: a monotonic clock read
+// at each end of the span and an atomic increment. Spans can be recorded
+// from any thread.
+class TRACE {
+public:
+	static const int SIZE = 1 << 16;
+
+	struct EVENT {
+		const char	*name;
+		uint64_t	 start;
+		uint64_t	 end;
+		int			 tid;
+	};
+
+	static TRACE &instance()
+	{
+		static TRACE	trace;
+		return trace;
+	}
+
+	// Nanoseconds on the monotonic clock
+	static uint64_t now()
+	{
+		timespec	ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	// The name must be a string literal (or otherwise outlive the trace)
+	void record(const char *name, uint64_t start, uint64_t end)
+	{
+		static thread_local int	tid = syscall(SYS_gettid);
+
+		EVENT	&event = myEvents[myNext.fetch_add(1) % SIZE];
+		event.name = name;
+		event.start = start;
+		event.end = end;
+		event.tid = tid;
+	}
+
+	// Write the recorded spans in the Chrome trace event format, which can
+	// be loaded by chrome://tracing or Perfetto
+	bool write(const char *fname) const
+	{
+		FILE	*fp = fopen(fname, "w");
+		if (!fp)
+			return false;
+
+		const uint64_t	next = myNext;
+		const uint64_t	first = next > SIZE ? next - SIZE : 0;
+		const int		pid = getpid();
+
+		fprintf(fp, "{\"traceEvents\":[\n");
+		for (uint64_t i = first; i < next; i++)
+		{
+			const EVENT	&event = myEvents[i % SIZE];
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+					"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}\n",
+					i == first ? "" : ",", event.name, pid, event.tid,
+					event.start / 1000.0, (event.end - event.start) / 1000.0);
+		}
+		fprintf(fp, "]}\n");
+
+		return !fclose(fp);
+	}
+
+private:
+	TRACE() : myNext(0) {}
+
+	EVENT					myEvents[SIZE];
+	std::atomic<uint64_t>	myNext;
+};
+
+// Record a span for the lifetime of the object
+class TRACE_SCOPE {
+public:
+	 TRACE_SCOPE(const char *name) : myName(name), myStart(TRACE::now()) {}
+	~TRACE_SCOPE()
+	{
+		TRACE::instance().record(myName, myStart, TRACE::now());
+	}
+
+private:
+	const char	*myName;
+	uint64_t	 myStart;
+};
+
+#endif